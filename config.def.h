@@ -10,7 +10,18 @@
 #define RFM_MX_ARGS 128 /* Maximum allowed number of command line arguments in action commands below */
 #define RFM_MOUNT_MEDIA_PATH "/run/media" /* Where specified mount handler mounts filesystems (e.g. udisksctl mount) */
 #define RFM_MTIME_OFFSET 60      /* Display modified files as bold text (age in seconds) */
-#define RFM_INOTIFY_TIMEOUT 500  /* ms between inotify events after which a full refresh is done */
+#define RFM_INOTIFY_TIMEOUT 500  /* Minimum ms after an inotify event before the changed items are read again */
+#define RFM_INOTIFY_LOAD 20      /* Maximum percentage of main thread time spent applying inotify changes: the delay grows with their cost */
+#define RFM_INOTIFY_MAX_DELAY 5000 /* ms: changes are shown no later than this after the first event, however busy the directory */
+#define RFM_READDIR_BUDGET 8     /* ms of each main loop iteration spent reading directory items; input is handled between batches */
+#define RFM_DIRCACHE_SIZE 65536  /* KB of memory used to keep listings of recently visited directories for instant redisplay; 0 to disable */
+#define RFM_DIRCACHE_DIRS 16     /* Maximum number of cached directory listings: each one holds an inotify watch */
+#define RFM_SNAPSHOT_MIN 10000   /* Directories with at least this many items are saved in ~/.cache/rfm/dirs/ to show quickly next time; 0 to disable */
+#define RFM_SORT_COLLATE 2       /* Sorting of names: 0 byte order, 1 locale order, 2 locale order with numbers by value (file2 before file10) */
+#define RFM_SORT_THREADS 0       /* Threads used to sort large directories: 0 for one per CPU, 1 to sort on the main thread only */
+#define RFM_LAZY_MIME 1          /* 1: content types that can't be told from the name are found by reading the file only for items shown; 0: for all items as they are read */
+#define RFM_ICON_ATLAS 1         /* 1: icons used are saved in ~/.cache/rfm/icons.cache and loaded from there at startup while the icon theme is unchanged */
+#define RFM_THUMB_THREADS 0      /* Threads used to make thumbnails: 0 for one per CPU */
 
 /* Built in commands - MUST be present */
 static const char *f_rm[]   = { "/bin/rm", "-r", "-f", NULL };
@@ -157,7 +168,7 @@ static RFM_ToolButtons tool_buttons[] = {
  * where path is the path and filename of the file to be thumbnailed, and size is
  * the size of the thumbnail (RFM_THUMBNAIL_SIZE will be passed).
  * The function should return the thumbnail as a pixbuf.
- * NOTE that the thumbnailing code is run in a separate thread!
+ * NOTE that the thumbnailing code is run in several threads at once (see RFM_THUMB_THREADS): it must be thread safe!
  */
 
 //#include "libdcmthumb/dcmThumb.h"
@@ -8,12 +8,15 @@
  *            OR use the supplied Makefile.
  */
 
+#define _GNU_SOURCE  /* openat(), fdopendir(), fstatat() and d_type with -std=c11 */
 #include <stdlib.h>
 #include <gtk/gtk.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/inotify.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <errno.h>
 #include <time.h>
 #include <stdio.h>
@@ -24,14 +27,45 @@
 #include <gdk/gdkdisplay.h>
 #include <gdk/gdkwayland.h>
 #include <gdk/gdkx.h>
+#ifdef RFM_USE_IO_URING
+#include <liburing.h>
+#endif
 
 #define PROG_NAME "rfm"
 #define DND_ACTION_MASK GDK_ACTION_ASK|GDK_ACTION_COPY|GDK_ACTION_MOVE
 #define INOTIFY_MASK IN_MOVE|IN_CREATE|IN_CLOSE_WRITE|IN_DELETE|IN_DELETE_SELF|IN_MOVE_SELF
+#define INOTIFY_THUMB_MASK (IN_MOVE|IN_CREATE|IN_DELETE)   /* rfm_thumbnail_wd */
 #define TARGET_URI_LIST 0
 #define N_TARGETS 1        /* G_N_ELEMENTS(target_entry) */
 #define PIPE_SZ 65535      /* Kernel pipe size */
 #define RFM_N_BUILT_IN 3   /* Number of built in actions */
+#define RFM_READDIR_POLL 10 /* ms between checks for items sent by the readDir() thread */
+#define RFM_READDIR_CHUNK 1024 /* Dir entries read by readDir() before they are stat'ed in inode order */
+#define RFM_SNIFF_SIZE 4096 /* Bytes read to sniff the content type if the file name is not conclusive */
+#define RFM_URING_DEPTH 512 /* io_uring submission queue entries per readDir() thread */
+#define RFM_INOTIFY_MAX_NAMES 4096 /* More changed names than this between inotify_flush() calls: read the whole directory again */
+#define RFM_PSORT_MIN 32768 /* Sorts of at least this many items are split over RFM_SORT_THREADS threads */
+#define RFM_PSORT_MAX_PARTS 16
+#define RFM_BULK_MIN 256 /* Batches of at least this many items are added to the store with icon_view's model unset */
+#define RFM_VIEW_MARGIN 64 /* Rows either side of those in view that resolve_visible() also finishes */
+#define RFM_COMPACT_MIN 1024 /* Removed or replaced items before compact_store() gives their memory back */
+#define RFM_SNIFF_THREADS 4 /* Threads reading the start of files for resolve_item() */
+#define RFM_THUMB_FRAME_TIME 4000 /* Microseconds thumb_loaded_show() spends showing loaded thumbnails per run */
+#define RFM_THUMB_FRAME_INTERVAL 16 /* Milliseconds between runs of thumb_loaded_show() */
+#define RFM_THUMB_LOADS_MAX 256 /* Thumbnails handed to thumb_load() and not yet shown: bounds the decoded pixbufs held */
+#define RFM_PNG_TEXT_MAX 4096 /* Longer PNG tEXt chunks are skipped by thumb_png_valid() */
+#define RFM_ARENA_BLOCK 65536 /* Bytes per block of records in an RFM_Arena; also the RFM_Arena string chunk size */
+#define RFM_MALLOC_CHUNK(n) MAX(32, ((n)+8+15) & ~(gsize)15) /* glibc heap use for a malloc() of n bytes: for arena_stats() */
+#define RFM_SNAPSHOT_MAGIC "RFMSNAP1"
+#define RFM_SNAPSHOT_SYMLINK (1<<0)
+#define RFM_SNAPSHOT_BROKEN  (1<<1)
+#define RFM_SNAPSHOT_GUESSED (1<<2)   /* Content type guessed from the name only */
+#define RFM_SNAPSHOT_MAX_FILES 64   /* Snapshots kept by snapshot_prune(), most recently used first */
+#define RFM_SNAPSHOT_MAX_AGE 30     /* Days since a snapshot was last used before snapshot_prune() removes it */
+#define RFM_ATLAS_MAGIC "RFMICON1"
+#define RFM_EMBLEM_SYMLINK   (1<<0)  /* Emblems composited on to an icon in rfm_iconCache */
+#define RFM_EMBLEM_UNMOUNTED (1<<1)
+#define RFM_EMBLEM_MOUNTED   (1<<2)
 
 typedef struct {
    gchar *thumbRoot;
@@ -47,8 +81,36 @@ typedef struct {
    guint64 mtime_file;
    gint t_idx;
    pid_t rfm_pid;
+   guint64 mtime_wanted;   /* Newer mtime seen while mkThumb() was running: made again by thumb_done() */
+   gint state;          /* RFM_THUMB_LOADING, RFM_THUMB_QUEUED, RFM_THUMB_RUNNING or RFM_THUMB_DONE */
+   guint record;        /* Store record the thumbnail is for */
+   guint priority;      /* Rows from the visible range when last ordered by thumb_prioritise(): 0 if in view */
+   gint generation;     /* rfm_thumbGeneration when handed to rfm_thumbPool */
+   gint cancelled;      /* Set by thumb_prioritise() if the row scrolled away before mkThumb() started */
+   gboolean made;       /* Set by mkThumb() if a thumbnail was saved */
 } RFM_ThumbQueueData;
 
+typedef struct {   /* A thumbnail read from the disk cache by thumb_load() */
+   gchar *thumb_name;
+   gchar *path;         /* File the thumbnail is for */
+   gchar *uri;          /* Checked against Thumb::URI if not NULL */
+   guint64 mtime;       /* Checked against Thumb::MTime */
+   guint record;
+   gint generation;     /* rfm_thumbGeneration when requested */
+   gboolean forJob;     /* The rfm_thumbJobs entry for path is waiting for the result */
+   gboolean make;       /* ... and should be made if the thumbnail can't be loaded */
+   GdkPixbuf *pixbuf;   /* NULL if missing, out of date or unreadable */
+} RFM_ThumbLoad;
+
+typedef struct {   /* A content type read by sniff_thread() for resolve_item() */
+   guint record;
+   gpointer fileAttributes;   /* The record when requested: compared, never dereferenced by the thread */
+   gint stamp;                /* store->stamp when requested */
+   gchar *path;
+   guint64 file_size;
+   gchar *mime_type;
+} RFM_SniffJob;
+
 typedef struct {
    gchar *runName;
    gchar *runRoot;
@@ -102,24 +164,77 @@ typedef struct {
    gint        rfm_sortColumn;   /* The column in the tree model to sort on */
    GUnixMountMonitor *rfm_mountMonitor;   /* Reference for monitor mount events */
    gint        showMimeType;              /* Display detected mime type on stdout when a file is right-clicked: toggled via -i option */
-   guint       delayedRefresh_GSourceID;  /* Main loop source ID for fill_store() delayed refresh timer */
+   guint       delayedRefresh_GSourceID;  /* Main loop source ID for refresh_store() delayed refresh timer */
+   guint       inotifyFlush_GSourceID;    /* Main loop source ID for inotify_flush() timer */
 } RFM_ctx;
 
-typedef struct {  /* Update free_fileAttributes() and malloc_fileAttributes() if new items are added */
-   gchar *path;
+typedef struct {  /* Allocated in an RFM_Arena by malloc_fileAttributes(): update free_fileAttributes() if new objects are added */
+   gchar *path;            /* Strings in the arena */
    gchar *file_name;
    gchar *display_name;
+   gchar *collate_key;     /* Sort key for file_name, see get_collate_key(); NULL if RFM_SORT_COLLATE is 0 */
    gboolean is_dir;
    gboolean is_mountPoint;
    GdkPixbuf *pixbuf;
-   gchar *mime_root;
-   gchar *mime_sub_type;
+   const gchar *mime_root; /* Interned strings: see arena_intern() */
+   const gchar *mime_sub_type;
    gboolean is_symlink;
    guint64 file_mtime;
-   gchar *icon_name;
+   guint64 file_size;      /* From the stat done by readDir(): 0 for items added by inotify_insert_item() */
+   guint64 file_ino;       /* 0 if not known, e.g. items shown from a snapshot */
+   const gchar *extension; /* Points into file_name at the last '.'; NULL if there isn't one */
+   const gchar *icon_name;
+   GdkPixbuf *thumbnail;   /* Shown instead of pixbuf once loaded by thumb_loaded_show() */
+   gboolean mime_guessed;  /* Content type from the name only: the file is read by resolve_item() if it is shown */
+   gboolean resolved;      /* Theme icon loaded and any guessed content type checked: see resolve_visible() */
 } RFM_FileAttributes;
 
+/* Memory for the RFM_FileAttributes of a directory read and their path and name strings. Records are packed into
+ * RFM_ARENA_BLOCK byte blocks and strings into a GStringChunk; nothing is freed until the last reference goes.
+ * An arena is only filled by one thread: each readDir() thread has its own, the store has one for the main thread.
+ */
+typedef struct {
+   gint ref_count;
+   GSList *blocks;         /* Newest block first */
+   gsize block_used;       /* Bytes used in the newest block */
+   GStringChunk *strings;
+   guint n_records;        /* For arena_stats() */
+   gsize size;             /* Bytes used by records and strings */
+   gsize malloc_size;      /* The same with a malloc() per record and string, as before arenas were used */
+} RFM_Arena;
+
+typedef struct {  /* Key of rfm_iconCache */
+   const gchar *icon_name;    /* Interned */
+   gint size;
+   guint emblem;              /* RFM_EMBLEM_* */
+} RFM_IconKey;
+
+/* Icon atlas file, a copy of rfm_iconCache saved on exit: a header, n_icons records, a string pool, then the
+ * pixel data of each icon. The pixbufs are made on the mapped file, so no icon is decoded at startup.
+ */
+typedef struct {
+   gchar magic[8];            /* RFM_ATLAS_MAGIC */
+   guint32 n_icons;
+   guint32 pool_size;
+   gint64 theme_mtime;        /* atlas_theme_mtime() when written */
+   guint32 theme;             /* Pool offset of the icon theme name */
+   guint32 unused;
+} RFM_AtlasHeader;
+
+typedef struct {
+   guint32 name;              /* Pool offset */
+   gint32 size;
+   guint32 emblem;
+   guint32 has_alpha;
+   gint32 width;              /* 0 if the theme has no such icon */
+   gint32 height;
+   gint32 rowstride;
+   guint32 unused;
+   guint64 pixels;            /* File offset of the pixel data: 8 bit RGB(A) */
+} RFM_AtlasIcon;
+
 typedef struct {
+   gint ref_count;   /* Held by the window and each readDir() thread: see default_pixbufs_unref() */
    GdkPixbuf *file, *dir;
    GdkPixbuf *symlinkDir;
    GdkPixbuf *symlinkFile;
@@ -134,6 +249,101 @@ typedef struct {
    GdkPixbuf *info;
 } RFM_defaultPixbufs;
 
+typedef struct {   /* See iconView_save() */
+   GList *selected;
+   gboolean scroll;
+   guint topRecord;
+} RFM_ViewState;
+
+/* The model shown by icon_view: a list model holding RFM_FileAttributes records in one array. Rows are
+ * the records in sort order; an iter is the record index, so iters stay valid until rfm_store_clear().
+ * rfm_store_remove() leaves a NULL record in place of the removed item.
+ */
+typedef struct {
+   GObject parent;
+   gint stamp;
+   GPtrArray *records;  /* RFM_FileAttributes: owned by the store */
+   GArray *order;       /* guint record index of each row */
+   GArray *rows;        /* guint row of each record */
+   GHashTable *names;   /* file_name to record index: built by rfm_store_lookup() when first needed */
+   gint sort_column_id;
+   gboolean silent;     /* No view attached: rfm_store_append() and rfm_store_steal_all() emit no row signals, see iconView_detach() */
+   GPtrArray *arenas;   /* References to the RFM_Arenas holding the records */
+   RFM_Arena *arena;    /* For records made on the main thread: see rfm_store_arena() */
+   guint n_dead;        /* Records removed or replaced since the store was filled: see rfm_store_compact() */
+   gboolean unsorted;   /* Records changed while silent may be out of order: sorted by iconView_attach() */
+} RFM_Store;
+
+typedef struct {
+   GObjectClass parent_class;
+} RFM_StoreClass;
+
+typedef struct {  /* A directory read in progress: owned by the readDir() thread */
+   gchar *path;                     /* Copy of rfm_curPath when the read started */
+   gint generation;                 /* rfm_readDirGeneration when the read started */
+   time_t mtimeThreshold;
+   GHashTable *mount_hash;          /* Reference to rfm_mount_hash when the read started */
+   RFM_defaultPixbufs *defaultPixbufs;   /* Reference: the thread may outlive the window */
+   gchar *snapshotPath;             /* Snapshot file for path; NULL if snapshots are disabled */
+   RFM_Arena *arena;                /* Items read by this thread */
+   gboolean reconcile;              /* Started by refresh_store(): the store already has the items, so no snapshot is shown */
+} RFM_ReadDirCtx;
+
+typedef struct {  /* Name and inode from readdir(): stat calls are made in inode order */
+   ino_t ino;
+   unsigned char type;   /* d_type: DT_UNKNOWN if the file system doesn't provide it */
+   gchar *name;
+   gint stat_status;     /* 0: not stat'ed yet (get_file_info() will stat); 1: statbuf is valid; -1: stat failed */
+   struct stat statbuf;  /* Target of symlinks, unless is_broken */
+   gboolean is_symlink;
+   gboolean is_broken;
+   guchar *sniff;        /* First bytes of the file if already read for content type sniffing */
+   ssize_t sniff_size;   /* -1: not read yet */
+} RFM_DirEntry;
+
+typedef struct {  /* Sent from the readDir() thread to the main thread via rfm_readDirQueue */
+   gint generation;
+   GPtrArray *fileAttributes;       /* Main thread takes the items if generation is current */
+   GPtrArray *updates;              /* Replacements for items already shown from a snapshot (matched by file_name) */
+   RFM_Arena *arena;                /* Reference to the arena holding the items */
+   gboolean last;                   /* No more batches for this generation */
+} RFM_ReadDirBatch;
+
+/* Directory snapshot file, written by readDir() for large directories: a header, n_records records sorted
+ * by name, then a string pool. Offsets are into the pool; pool offset 0 is the empty string.
+ */
+typedef struct {
+   gchar magic[8];                  /* RFM_SNAPSHOT_MAGIC */
+   guint32 n_records;
+   guint32 path;                    /* The directory this is a snapshot of */
+   guint64 dev;                     /* Directory device, inode and mtime when the snapshot was read */
+   guint64 ino;
+   gint64 mtime_sec;
+   gint64 mtime_nsec;
+} RFM_SnapshotHeader;
+
+typedef struct {
+   guint32 name;
+   guint32 mime;                    /* Content type, for anything but directories and broken symlinks */
+   guint32 mode;
+   guint32 flags;                   /* RFM_SNAPSHOT_* */
+   guint64 mtime;
+   guint64 size;
+   guint32 mtime_nsec;
+   guint32 unused;
+} RFM_SnapshotRecord;
+
+typedef struct {  /* Listing of a previously visited directory: see dirCache_stash() */
+   gchar *path;
+   int wd;                    /* inotify watch: any change to the directory drops the entry */
+   struct timespec mtime;     /* Directory times when stashed: checked again before reuse */
+   struct timespec ctime;
+   GPtrArray *fileAttributes; /* Records taken from the store */
+   GPtrArray *arenas;         /* ... and the arenas holding them */
+   gchar *scrollName;         /* First visible item */
+   gsize size;                /* Approximate memory used */
+} RFM_DirCacheEntry;
+
 enum {
    COL_DISPLAY_NAME,
    COL_PIXBUF,
@@ -141,6 +351,24 @@ enum {
    COL_ATTR,
    NUM_COLS
 };
+enum {   /* Sort orders without a model column: see compare_fileAttributes() and refresh_other() */
+   RFM_SORT_SIZE=NUM_COLS,
+   RFM_SORT_EXT,
+   RFM_SORT_TYPE
+};
+
+enum {   /* uring_stat_dirEntries() */
+   RFM_URING_OK,
+   RFM_URING_UNSUPPORTED,
+   RFM_URING_BROKEN
+};
+
+enum {   /* RFM_ThumbQueueData state */
+   RFM_THUMB_LOADING,   /* Waiting for thumb_load() */
+   RFM_THUMB_QUEUED,
+   RFM_THUMB_RUNNING,
+   RFM_THUMB_DONE
+};
 
 enum {   /* runOpts */
    RFM_EXEC_NONE=       1<<0,
@@ -164,17 +392,40 @@ static GtkWidget *icon_view;
 
 static gchar *rfm_homePath;         /* Users home dir */
 static gchar *rfm_thumbDir;         /* Users thumbnail directory */
+static gchar *rfm_snapshotDir;      /* Directory snapshots for large directories (see readDir()) */
 static gint rfm_do_thumbs;          /* Show thumbnail images of files: 0: disabled; 1: enabled; 2: disabled for current dir */
-static GList *rfm_fileAttributeList=NULL; /* Store holds references to this list: use clear_store() to free */
-static GList *rfm_thumbQueue=NULL;
+static GList *rfm_thumbQueue=NULL;      /* Jobs waiting for rfm_thumbPool: all are in rfm_thumbJobs */
+static GHashTable *rfm_thumbJobs=NULL;  /* Thumbnail jobs for the current directory by path: see get_thumbData() */
 static GList *rfm_childList=NULL;
 
-static guint rfm_readDirSheduler=0;
-static guint rfm_thumbScheduler=0;
+static guint rfm_readDirSheduler=0;   /* Main loop source receiving batches from the readDir() thread */
+static GAsyncQueue *rfm_readDirQueue=NULL;
+static gint rfm_readDirGeneration=0;   /* Incremented by rfm_stop_all(): readDir() threads and batches with an older value are stale */
+static GThreadPool *rfm_thumbPool=NULL;  /* Runs mkThumb(): NULL if thumbnails are disabled */
+static guint rfm_thumbsInFlight=0;      /* Jobs handed to rfm_thumbPool and not back yet (see thumb_done()) */
+static GList *rfm_thumbsRunning=NULL;   /* The jobs in flight, for thumb_prioritise() */
+static guint rfm_thumbPrioritiser=0;    /* Idle source for thumb_prioritise() */
+static GThreadPool *rfm_thumbLoadPool=NULL;  /* Runs thumb_load() */
+static GAsyncQueue *rfm_thumbLoaded=NULL;    /* Results from thumb_load() for thumb_loaded_show() */
+static GQueue rfm_thumbLoadWaiting=G_QUEUE_INIT;   /* Requests not yet handed to rfm_thumbLoadPool */
+static guint rfm_thumbLoadsPending=0;   /* Requests waiting, loading or loaded and not yet shown */
+static guint rfm_thumbLoadsInPool=0;    /* ... of which handed to rfm_thumbLoadPool */
+static guint rfm_thumbLoadTimer=0;      /* Timeout source running thumb_loaded_show() */
+static GHashTable *rfm_thumbIndex=NULL; /* Names of the thumbnails in rfm_thumbDir: see thumb_index_read() */
+static gboolean rfm_thumbIndexReady=FALSE;    /* rfm_thumbIndex is complete: names not in it needn't be looked for */
+static gboolean rfm_thumbIndexReading=FALSE;
+static gboolean rfm_thumbIndexStale=FALSE;    /* Events were lost while reading: read again */
+static guint rfm_thumbsMaxInFlight=0;
+static gint rfm_thumbGeneration=0;      /* Incremented by rfm_stop_all(): jobs with an older value are skipped */
+static guint rfm_thumbsMade=0;          /* For the rate shown by thumb_dispatch() */
+static gint64 rfm_thumbsStart=0;
+static guint rfm_resolveScheduler=0;  /* Idle source for resolve_visible() */
+static GThreadPool *rfm_sniffPool=NULL;  /* Runs sniff_thread() */
+static guint rfm_sniffsPending=0;
 
 static int rfm_inotify_fd;
 static int rfm_curPath_wd;    /* Current path (rfm_curPath) watch */
-static int rfm_thumbnail_wd;  /* Thumbnail watch */
+static int rfm_thumbnail_wd=-1;  /* Thumbnail watch */
 
 static gchar *rfm_curPath=NULL;  /* The current directory */
 static gchar *rfm_prePath=NULL;  /* Previous directory: only set when up button is pressed, otherwise should be NULL */
@@ -185,10 +436,27 @@ static GtkToolItem *stop_button;
 static GtkToolItem *info_button;
 
 static GtkIconTheme *icon_theme;
-
-static GHashTable *thumb_hash=NULL; /* Thumbnails in the current view */
-
-static GtkListStore *store=NULL;
+static GHashTable *rfm_iconCache=NULL; /* RFM_IconKey to shared GdkPixbuf (NULL if the theme has no such icon): see icon_cache_lookup() */
+static gboolean rfm_iconCacheChanged=FALSE; /* Icons added since the atlas was loaded: see atlas_save() */
+static gchar *rfm_atlasPath=NULL;      /* NULL if RFM_ICON_ATLAS is 0 */
+static gint64 rfm_startTime=0;         /* For the time to first frame: see first_frame() */
+
+static GHashTable *thumb_hash=NULL; /* Thumbnails in the current view: thumbnail name to store record index */
+static GHashTable *rfm_dirtyNames=NULL; /* Names in rfm_curPath with inotify events since the last inotify_flush() */
+static GByteArray *rfm_reconcileSeen=NULL; /* During refresh_store(): non-zero for each record found again by the read */
+static gint64 rfm_inotifyPending=0;    /* Monotonic time of the first inotify event not yet shown; 0 if none: see inotify_delay() */
+static gint64 rfm_flushCost=0;         /* Main thread us taken by the last inotify_flush() */
+static gint64 rfm_refreshCost=0;       /* ... and by readDirReceive() for the last refresh_store() */
+static gint64 rfm_readDirCost=0;       /* Main thread us taken by readDirReceive() so far for the current read */
+static gboolean rfm_refreshAfterRead=FALSE; /* delayed_refreshAll() was due while a read was running: refresh once it ends */
+static GHashTable *rfm_mount_hash=NULL; /* Mount points from fstab and /proc/mounts: rebuilt by mounts_handler() only when mounts change */
+
+static GQueue rfm_dirCache=G_QUEUE_INIT; /* RFM_DirCacheEntry, most recently used first */
+static GHashTable *rfm_dirCacheWds=NULL;  /* inotify wd to RFM_DirCacheEntry; NULL value if the watch was removed but IN_IGNORED is still to come */
+static gsize rfm_dirCacheSize=0;
+static gboolean rfm_dirCacheable=FALSE;  /* Store holds the complete listing of rfm_curPath */
+
+static RFM_Store *store=NULL;
 
 /* Functions */
 static gboolean inotify_handler(gint fd, GIOCondition condition, gpointer rfmCtx);
@@ -200,6 +468,14 @@ static void cleanup(GtkWidget *window, RFM_ctx *rfmCtx);
 static void show_child_output(RFM_ChildAttribs *child_attribs);
 static void set_rfm_curPath(gchar* path);
 static void fill_store(RFM_ctx *rfmCtx);
+static void schedule_thumbs(void);
+static void compact_store(void);
+static void schedule_resolve(void);
+static void thumb_index_start(void);
+static void thumb_watch_add(void);
+static void refresh_store(RFM_ctx *rfmCtx);
+static gboolean delayed_refreshAll(gpointer user_data);
+static void dirCache_clear(void);
 static void up_clicked(GtkToolItem *item, gpointer user_data);
 static void home_clicked(GtkToolItem *item, gpointer user_data);
 static gboolean popup_file_menu(GdkEvent *event, RFM_ctx *rfmCtx);
@@ -218,6 +494,16 @@ static void free_thumbQueueData(RFM_ThumbQueueData *thumbData)
    free(thumbData);
 }
 
+/* Jobs running in rfm_thumbPool are left to thumb_done() */
+static gboolean thumb_job_free(gpointer key, gpointer value, gpointer user_data)
+{
+   RFM_ThumbQueueData *thumbData=value;
+
+   if (thumbData->state!=RFM_THUMB_RUNNING)
+      free_thumbQueueData(thumbData);
+   return TRUE;
+}
+
 static void free_child_attribs(RFM_ChildAttribs *child_attribs)
 {
    g_free(child_attribs->stdOut);
@@ -226,22 +512,123 @@ static void free_child_attribs(RFM_ChildAttribs *child_attribs)
    g_free(child_attribs);
 }
 
-static void rfm_stop_all(RFM_ctx *rfmCtx) {
+static RFM_Arena *arena_new(void)
+{
+   RFM_Arena *arena=g_new0(RFM_Arena, 1);
+   arena->ref_count=1;
+   arena->block_used=RFM_ARENA_BLOCK;   /* No block yet */
+   arena->strings=g_string_chunk_new(RFM_ARENA_BLOCK);
+   return arena;
+}
+
+static RFM_Arena *arena_ref(RFM_Arena *arena)
+{
+   g_atomic_int_inc(&arena->ref_count);
+   return arena;
+}
+
+static void arena_unref(RFM_Arena *arena)
+{
+   if (!g_atomic_int_dec_and_test(&arena->ref_count))
+      return;
+   g_slist_free_full(arena->blocks, g_free);
+   g_string_chunk_free(arena->strings);
+   g_free(arena);
+}
+
+/* Zeroed memory: size must be less than RFM_ARENA_BLOCK */
+static gpointer arena_alloc(RFM_Arena *arena, gsize size)
+{
+   gpointer mem;
+
+   size=(size+7) & ~(gsize)7;
+   if (arena->block_used+size > RFM_ARENA_BLOCK) {
+      arena->blocks=g_slist_prepend(arena->blocks, g_malloc0(RFM_ARENA_BLOCK));
+      arena->block_used=0;
+   }
+   mem=(gchar*)arena->blocks->data+arena->block_used;
+   arena->block_used+=size;
+   arena->size+=size;
+   arena->malloc_size+=RFM_MALLOC_CHUNK(size);
+   return mem;
+}
+
+static gchar *arena_strdup(RFM_Arena *arena, const gchar *string)
+{
+   gsize len=strlen(string)+1;
+
+   arena->size+=len;
+   arena->malloc_size+=RFM_MALLOC_CHUNK(len);
+   return g_string_chunk_insert_len(arena->strings, string, len-1);
+}
+
+/* Content types and icon names are the same for many items: keep one copy of each for the life of the program */
+static const gchar *arena_intern(RFM_Arena *arena, const gchar *string)
+{
+   arena->malloc_size+=RFM_MALLOC_CHUNK(strlen(string)+1);
+   return g_intern_string(string);
+}
+
+/* Memory used per item: shown with G_MESSAGES_DEBUG=all */
+static void arena_stats(RFM_Arena *arena, const gchar *path)
+{
+   if (arena->n_records > 0)
+      g_debug("%s: %u items, %" G_GSIZE_FORMAT " bytes per item (%" G_GSIZE_FORMAT " with a malloc() per string)",
+              path, arena->n_records, arena->size/arena->n_records, arena->malloc_size/arena->n_records);
+}
+
+static void free_fileAttributes(RFM_FileAttributes *fileAttributes);
+static RFM_FileAttributes *copy_fileAttributes(RFM_Arena *arena, RFM_FileAttributes *fileAttributes);
+
+static void free_readDirBatch(RFM_ReadDirBatch *batch)
+{
+   g_ptr_array_foreach(batch->fileAttributes, (GFunc)free_fileAttributes, NULL);
+   g_ptr_array_free(batch->fileAttributes, TRUE);
+   g_ptr_array_foreach(batch->updates, (GFunc)free_fileAttributes, NULL);
+   g_ptr_array_free(batch->updates, TRUE);
+   arena_unref(batch->arena);
+   g_free(batch);
+}
+
+/* Stop any directory read, refresh or pending inotify update; thumbnailing carries on */
+static void stop_readDir(RFM_ctx *rfmCtx) {
+   RFM_ReadDirBatch *batch;
+
+   /* Any running readDir() thread will see the new generation and finish; discard what it has already sent */
+   g_atomic_int_inc(&rfm_readDirGeneration);
+   while ((batch=g_async_queue_try_pop(rfm_readDirQueue))!=NULL)
+      free_readDirBatch(batch);
+
    if (rfmCtx->delayedRefresh_GSourceID > 0)
       g_source_remove(rfmCtx->delayedRefresh_GSourceID);
 
+   if (rfmCtx->inotifyFlush_GSourceID > 0)
+      g_source_remove(rfmCtx->inotifyFlush_GSourceID);
+   g_hash_table_remove_all(rfm_dirtyNames);   /* Superseded by a full read */
+
    if (rfm_readDirSheduler>0)
       g_source_remove(rfm_readDirSheduler);
 
-   if (rfm_thumbScheduler>0)
-      g_source_remove(rfm_thumbScheduler);
+   if (rfm_reconcileSeen!=NULL)
+      g_byte_array_free(rfm_reconcileSeen, TRUE);
 
    rfmCtx->delayedRefresh_GSourceID=0;
+   rfmCtx->inotifyFlush_GSourceID=0;
    rfm_readDirSheduler=0;
-   rfm_thumbScheduler=0;
+   rfm_reconcileSeen=NULL;
+   rfm_refreshAfterRead=FALSE;
+   rfm_inotifyPending=0;
+}
+
+static void rfm_stop_all(RFM_ctx *rfmCtx) {
+   stop_readDir(rfmCtx);
 
-   g_list_free_full(rfm_thumbQueue, (GDestroyNotify)free_thumbQueueData);
+   g_atomic_int_inc(&rfm_thumbGeneration);   /* Jobs already in rfm_thumbPool are skipped */
+
+   g_list_free(rfm_thumbQueue);
    rfm_thumbQueue=NULL;
+   if (rfm_thumbJobs!=NULL)
+      g_hash_table_foreach_remove(rfm_thumbJobs, thumb_job_free, NULL);
 }
 
 /* Supervise the children to prevent blocked pipes */
@@ -356,6 +743,273 @@ static int read_char_pipe(gint fd, ssize_t block_size, char **buffer)
    return read_size;
 }
 
+static guint icon_key_hash(gconstpointer key)
+{
+   const RFM_IconKey *iconKey=key;
+   return g_direct_hash(iconKey->icon_name) ^ (iconKey->size<<8) ^ iconKey->emblem;
+}
+
+static gboolean icon_key_equal(gconstpointer a, gconstpointer b)
+{
+   const RFM_IconKey *keyA=a;
+   const RFM_IconKey *keyB=b;
+   return keyA->icon_name==keyB->icon_name && keyA->size==keyB->size && keyA->emblem==keyB->emblem;
+}
+
+static void free_cachedIcon(GdkPixbuf *pixbuf)
+{
+   if (pixbuf!=NULL) g_object_unref(pixbuf);
+}
+
+/* Icons are shared by every item showing them: rfm_iconCache holds one pixbuf for each icon name, size and
+ * emblem, loaded or composited on first use. Cached pixbufs are never changed, and misses are cached as NULL
+ * so the theme is only asked once. Main thread only. TRUE if found: *pixbuf is not referenced.
+ */
+static gboolean icon_cache_lookup(const gchar *icon_name, gint size, guint emblem, GdkPixbuf **pixbuf)
+{
+   RFM_IconKey key={ g_intern_string(icon_name), size, emblem };
+   return g_hash_table_lookup_extended(rfm_iconCache, &key, NULL, (gpointer)pixbuf);
+}
+
+/* The cache takes pixbuf, which may be NULL */
+static void icon_cache_insert(const gchar *icon_name, gint size, guint emblem, GdkPixbuf *pixbuf)
+{
+   RFM_IconKey *key=g_new(RFM_IconKey, 1);
+
+   key->icon_name=g_intern_string(icon_name);
+   key->size=size;
+   key->emblem=emblem;
+   if (!g_hash_table_contains(rfm_iconCache, key))
+      rfm_iconCacheChanged=TRUE;
+   g_hash_table_replace(rfm_iconCache, key, pixbuf);
+}
+
+/* Cached replacement for gtk_icon_theme_load_icon(): returns a reference, or NULL if the theme has no such icon */
+static GdkPixbuf *icon_cache_theme(const gchar *icon_name, gint size)
+{
+   GdkPixbuf *pixbuf;
+
+   if (!icon_cache_lookup(icon_name, size, 0, &pixbuf)) {
+      pixbuf=gtk_icon_theme_load_icon(icon_theme, icon_name, size, 0, NULL);
+      icon_cache_insert(icon_name, size, 0, pixbuf);
+   }
+   return (pixbuf!=NULL) ? g_object_ref(pixbuf) : NULL;
+}
+
+/* Copy of pixbuf with emblem drawn on it at x=y=dest */
+static GdkPixbuf *composite_emblem(GdkPixbuf *pixbuf, GdkPixbuf *emblem, int dest, int alpha)
+{
+   GdkPixbuf *composite=gdk_pixbuf_copy(pixbuf);
+   gdk_pixbuf_composite(emblem, composite, dest, dest, gdk_pixbuf_get_width(emblem), gdk_pixbuf_get_height(emblem), 0, 0, 1, 1, GDK_INTERP_NEAREST, alpha);
+   return composite;
+}
+
+static gchar *atlas_theme_name(void)
+{
+   gchar *theme=NULL;
+
+   #ifdef RFM_ICON_THEME
+      theme=g_strdup(RFM_ICON_THEME);
+   #else
+      g_object_get(gtk_settings_get_default(), "gtk-icon-theme-name", &theme, NULL);
+   #endif
+   return (theme!=NULL) ? theme : g_strdup("hicolor");
+}
+
+/* Latest change to the icon theme or to hicolor, which all themes fall back to: in each icon directory, the theme
+ * directory changes when it is added or removed, and gtk-update-icon-cache rewrites icon-theme.cache when icons are
+ * installed. The atlas is only used if this hasn't changed since it was written.
+ */
+static gint64 atlas_theme_mtime(const gchar *theme)
+{
+   const gchar *themes[]={ theme, "hicolor" };
+   gchar **searchPath;
+   gchar *path;
+   gint n_paths, i, j, k;
+   gint64 mtime=0;
+   struct stat statbuf;
+
+   gtk_icon_theme_get_search_path(icon_theme, &searchPath, &n_paths);
+   for (i=0; i<n_paths; i++) {
+      for (j=0; j<G_N_ELEMENTS(themes); j++) {
+         for (k=0; k<2; k++) {
+            path=g_build_filename(searchPath[i], themes[j], k ? "icon-theme.cache" : NULL, NULL);
+            if (stat(path, &statbuf)==0)
+               mtime=MAX(mtime, (gint64)statbuf.st_mtim.tv_sec*G_GINT64_CONSTANT(1000000000)+statbuf.st_mtim.tv_nsec);
+            g_free(path);
+         }
+      }
+   }
+   g_strfreev(searchPath);
+   return mtime;
+}
+
+static void atlas_pixels_free(guchar *pixels, gpointer atlas)
+{
+   g_mapped_file_unref(atlas);
+}
+
+/* Fill rfm_iconCache from the atlas file written by an earlier run, if it is still valid for the icon theme:
+ * icon_cache_theme() then finds the icons rfm uses without searching the theme. The pixbufs share the mapped file.
+ */
+static void atlas_load(void)
+{
+   GMappedFile *atlas;
+   RFM_AtlasHeader *header;
+   RFM_AtlasIcon *icons;
+   const gchar *contents, *pool;
+   gsize length, pixels_size;
+   gchar *theme;
+   GdkPixbuf *pixbuf;
+   gboolean valid;
+   guint32 i;
+
+   if (rfm_atlasPath==NULL || (atlas=g_mapped_file_new(rfm_atlasPath, FALSE, NULL))==NULL)
+      return;
+   contents=g_mapped_file_get_contents(atlas);
+   length=g_mapped_file_get_length(atlas);
+   header=(RFM_AtlasHeader*)contents;
+   valid=(length >= sizeof(RFM_AtlasHeader) && memcmp(header->magic, RFM_ATLAS_MAGIC, 8)==0
+          && header->n_icons <= (length-sizeof(RFM_AtlasHeader))/sizeof(RFM_AtlasIcon)
+          && header->pool_size > 0 && header->pool_size <= length-sizeof(RFM_AtlasHeader)-header->n_icons*sizeof(RFM_AtlasIcon));
+   if (valid) {
+      icons=(RFM_AtlasIcon*)(header+1);
+      pool=(const gchar*)(icons+header->n_icons);
+      theme=atlas_theme_name();
+      valid=(pool[header->pool_size-1]=='\0' && header->theme < header->pool_size && strcmp(pool+header->theme, theme)==0
+             && header->theme_mtime==atlas_theme_mtime(theme));
+      g_free(theme);
+   }
+   for (i=0; valid && i<header->n_icons; i++) {
+      pixbuf=NULL;
+      if (icons[i].name >= header->pool_size)
+         break;
+      if (icons[i].width > 0) {
+         pixels_size=(gsize)icons[i].rowstride*(icons[i].height-1)+icons[i].width*(icons[i].has_alpha ? 4 : 3);
+         if (icons[i].height <= 0 || icons[i].rowstride < icons[i].width*(icons[i].has_alpha ? 4 : 3)
+               || icons[i].pixels > length || pixels_size > length-icons[i].pixels)
+            break;
+         pixbuf=gdk_pixbuf_new_from_data((const guchar*)contents+icons[i].pixels, GDK_COLORSPACE_RGB, icons[i].has_alpha, 8,
+                                         icons[i].width, icons[i].height, icons[i].rowstride, atlas_pixels_free, g_mapped_file_ref(atlas));
+      }
+      icon_cache_insert(pool+icons[i].name, icons[i].size, icons[i].emblem, pixbuf);
+   }
+   if (valid)
+      g_debug("%s: %u icons", rfm_atlasPath, i);
+   rfm_iconCacheChanged=(valid && i < header->n_icons);   /* Write a good copy if it was damaged */
+   g_mapped_file_unref(atlas);
+}
+
+/* Write rfm_iconCache to the atlas for the next run, if icons have been added to it */
+static void atlas_save(void)
+{
+   RFM_AtlasHeader header;
+   RFM_AtlasIcon icon;
+   RFM_IconKey *key;
+   GdkPixbuf *pixbuf;
+   GHashTableIter iter;
+   GArray *icons;
+   GString *pool, *pixels, *contents;
+   gchar *theme;
+   gsize offset;
+   guint i;
+
+   if (rfm_atlasPath==NULL || !rfm_iconCacheChanged)
+      return;
+   icons=g_array_new(FALSE, FALSE, sizeof(RFM_AtlasIcon));
+   pool=g_string_new(NULL);
+   pixels=g_string_new(NULL);
+   theme=atlas_theme_name();
+
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, RFM_ATLAS_MAGIC, 8);
+   header.theme_mtime=atlas_theme_mtime(theme);
+   header.theme=0;
+   g_string_append_len(pool, theme, strlen(theme)+1);
+
+   g_hash_table_iter_init(&iter, rfm_iconCache);
+   while (g_hash_table_iter_next(&iter, (gpointer)&key, (gpointer)&pixbuf)) {
+      memset(&icon, 0, sizeof(icon));
+      icon.name=pool->len;
+      g_string_append_len(pool, key->icon_name, strlen(key->icon_name)+1);
+      icon.size=key->size;
+      icon.emblem=key->emblem;
+      if (pixbuf!=NULL && gdk_pixbuf_get_colorspace(pixbuf)==GDK_COLORSPACE_RGB && gdk_pixbuf_get_bits_per_sample(pixbuf)==8) {
+         icon.has_alpha=gdk_pixbuf_get_has_alpha(pixbuf);
+         icon.width=gdk_pixbuf_get_width(pixbuf);
+         icon.height=gdk_pixbuf_get_height(pixbuf);
+         icon.rowstride=gdk_pixbuf_get_rowstride(pixbuf);
+         icon.pixels=pixels->len;   /* Relative to the pixel data for now */
+         g_string_append_len(pixels, (const gchar*)gdk_pixbuf_read_pixels(pixbuf), gdk_pixbuf_get_byte_length(pixbuf));
+         while (pixels->len % 8) g_string_append_c(pixels, '\0');
+      }
+      g_array_append_val(icons, icon);
+   }
+   header.n_icons=icons->len;
+   header.pool_size=pool->len;
+
+   offset=sizeof(header)+icons->len*sizeof(RFM_AtlasIcon)+pool->len;
+   offset=(offset+7) & ~(gsize)7;
+   for (i=0; i<icons->len; i++)
+      if (g_array_index(icons, RFM_AtlasIcon, i).width > 0)
+         g_array_index(icons, RFM_AtlasIcon, i).pixels+=offset;
+
+   contents=g_string_sized_new(offset+pixels->len);
+   g_string_append_len(contents, (const gchar*)&header, sizeof(header));
+   g_string_append_len(contents, (const gchar*)icons->data, icons->len*sizeof(RFM_AtlasIcon));
+   g_string_append_len(contents, pool->str, pool->len);
+   while (contents->len < offset) g_string_append_c(contents, '\0');
+   g_string_append_len(contents, pixels->str, pixels->len);
+   if (!g_file_set_contents(rfm_atlasPath, contents->str, contents->len, NULL))
+      g_warning("atlas_save: can't write %s", rfm_atlasPath);
+
+   g_string_free(contents, TRUE);
+   g_string_free(pixels, TRUE);
+   g_string_free(pool, TRUE);
+   g_array_free(icons, TRUE);
+   g_free(theme);
+}
+
+/* Composite default icon from rfm_iconCache (e.g. loaded from the atlas), or made and cached */
+static GdkPixbuf *default_composite(const gchar *icon_name, guint emblem, GdkPixbuf *pixbuf, GdkPixbuf *emblemPixbuf, int dest, int alpha)
+{
+   GdkPixbuf *composite;
+
+   if (icon_cache_lookup(icon_name, RFM_ICON_SIZE, emblem, &composite) && composite!=NULL)
+      return g_object_ref(composite);
+   composite=composite_emblem(pixbuf, emblemPixbuf, dest, alpha);
+   icon_cache_insert(icon_name, RFM_ICON_SIZE, emblem, g_object_ref(composite));
+   return composite;
+}
+
+static RFM_defaultPixbufs *default_pixbufs_ref(RFM_defaultPixbufs *defaultPixbufs)
+{
+   g_atomic_int_inc(&defaultPixbufs->ref_count);
+   return defaultPixbufs;
+}
+
+/* A readDir() thread may still be running when the window is destroyed: the last holder frees the pixbufs */
+static void default_pixbufs_unref(RFM_defaultPixbufs *defaultPixbufs)
+{
+   if (!g_atomic_int_dec_and_test(&defaultPixbufs->ref_count))
+      return;
+   g_object_unref(defaultPixbufs->file);
+   g_object_unref(defaultPixbufs->dir);
+   g_object_unref(defaultPixbufs->symlinkDir);
+   g_object_unref(defaultPixbufs->symlinkFile);
+   g_object_unref(defaultPixbufs->unmounted);
+   g_object_unref(defaultPixbufs->mounted);
+   g_object_unref(defaultPixbufs->symlink);
+   g_object_unref(defaultPixbufs->broken);
+   g_object_unref(defaultPixbufs->up);
+   g_object_unref(defaultPixbufs->home);
+   g_object_unref(defaultPixbufs->stop);
+   g_object_unref(defaultPixbufs->refresh);
+   g_object_unref(defaultPixbufs->info);
+   g_free(defaultPixbufs);
+}
+
+/* The default pixbufs are put in rfm_iconCache, so items with the same icon share them */
 static RFM_defaultPixbufs *load_default_pixbufs(void)
 {
    GdkPixbuf *umount_pixbuf;
@@ -365,10 +1019,11 @@ static RFM_defaultPixbufs *load_default_pixbufs(void)
    if(!(defaultPixbufs = calloc(1, sizeof(RFM_defaultPixbufs))))
       return NULL;
 
-   defaultPixbufs->file=gtk_icon_theme_load_icon(icon_theme, "application-octet-stream", RFM_ICON_SIZE, 0, NULL);
-   defaultPixbufs->dir=gtk_icon_theme_load_icon(icon_theme, "folder", RFM_ICON_SIZE, 0, NULL);
-   defaultPixbufs->symlink=gtk_icon_theme_load_icon(icon_theme, "emblem-symbolic-link", RFM_ICON_SIZE/2, 0, NULL);
-   defaultPixbufs->broken=gtk_icon_theme_load_icon(icon_theme, "emblem-unreadable", RFM_ICON_SIZE/2, 0, NULL);
+   defaultPixbufs->ref_count=1;
+   defaultPixbufs->file=icon_cache_theme("application-octet-stream", RFM_ICON_SIZE);
+   defaultPixbufs->dir=icon_cache_theme("folder", RFM_ICON_SIZE);
+   defaultPixbufs->symlink=icon_cache_theme("emblem-symbolic-link", RFM_ICON_SIZE/2);
+   defaultPixbufs->broken=icon_cache_theme("emblem-unreadable", RFM_ICON_SIZE/2);
 
    umount_pixbuf=gdk_pixbuf_new_from_xpm_data(RFM_icon_unmounted);
    mount_pixbuf=gdk_pixbuf_new_from_xpm_data(RFM_icon_mounted);
@@ -376,27 +1031,29 @@ static RFM_defaultPixbufs *load_default_pixbufs(void)
    if (defaultPixbufs->file==NULL) defaultPixbufs->file=gdk_pixbuf_new_from_xpm_data(RFM_icon_file);
    if (defaultPixbufs->dir==NULL) defaultPixbufs->dir=gdk_pixbuf_new_from_xpm_data(RFM_icon_folder);
    if (defaultPixbufs->symlink==NULL) defaultPixbufs->symlink=gdk_pixbuf_new_from_xpm_data(RFM_icon_symlink);
-   if (defaultPixbufs->broken==NULL) defaultPixbufs->symlink=gdk_pixbuf_new_from_xpm_data(RFM_icon_broken);
+   if (defaultPixbufs->broken==NULL) defaultPixbufs->broken=gdk_pixbuf_new_from_xpm_data(RFM_icon_broken);
+
+   /* Built in icons replace any the theme doesn't have */
+   icon_cache_insert("application-octet-stream", RFM_ICON_SIZE, 0, g_object_ref(defaultPixbufs->file));
+   icon_cache_insert("folder", RFM_ICON_SIZE, 0, g_object_ref(defaultPixbufs->dir));
+   icon_cache_insert("emblem-symbolic-link", RFM_ICON_SIZE/2, 0, g_object_ref(defaultPixbufs->symlink));
+   icon_cache_insert("emblem-unreadable", RFM_ICON_SIZE/2, 0, g_object_ref(defaultPixbufs->broken));
 
    /* Composite images */
-   defaultPixbufs->symlinkDir=gdk_pixbuf_copy(defaultPixbufs->dir);
-   gdk_pixbuf_composite(defaultPixbufs->symlink,defaultPixbufs->symlinkDir,0,0,gdk_pixbuf_get_width(defaultPixbufs->symlink),gdk_pixbuf_get_height(defaultPixbufs->symlink),0,0,1,1,GDK_INTERP_NEAREST,200);
-   defaultPixbufs->symlinkFile=gdk_pixbuf_copy(defaultPixbufs->file);
-   gdk_pixbuf_composite(defaultPixbufs->symlink,defaultPixbufs->symlinkFile,0,0,gdk_pixbuf_get_width(defaultPixbufs->symlink),gdk_pixbuf_get_height(defaultPixbufs->symlink),0,0,1,1,GDK_INTERP_NEAREST,200);
-   defaultPixbufs->unmounted=gdk_pixbuf_copy(defaultPixbufs->dir);
-   gdk_pixbuf_composite(umount_pixbuf,defaultPixbufs->unmounted,1,1,gdk_pixbuf_get_width(umount_pixbuf),gdk_pixbuf_get_height(umount_pixbuf),0,0,1,1,GDK_INTERP_NEAREST,100);
-   defaultPixbufs->mounted=gdk_pixbuf_copy(defaultPixbufs->dir);
-   gdk_pixbuf_composite(mount_pixbuf,defaultPixbufs->mounted,1,1,gdk_pixbuf_get_width(mount_pixbuf),gdk_pixbuf_get_height(mount_pixbuf),0,0,1,1,GDK_INTERP_NEAREST,100);
+   defaultPixbufs->symlinkDir=default_composite("folder", RFM_EMBLEM_SYMLINK, defaultPixbufs->dir, defaultPixbufs->symlink, 0, 200);
+   defaultPixbufs->symlinkFile=default_composite("application-octet-stream", RFM_EMBLEM_SYMLINK, defaultPixbufs->file, defaultPixbufs->symlink, 0, 200);
+   defaultPixbufs->unmounted=default_composite("folder", RFM_EMBLEM_UNMOUNTED, defaultPixbufs->dir, umount_pixbuf, 1, 100);
+   defaultPixbufs->mounted=default_composite("folder", RFM_EMBLEM_MOUNTED, defaultPixbufs->dir, mount_pixbuf, 1, 100);
 
    g_object_unref(umount_pixbuf);
    g_object_unref(mount_pixbuf);
    
    /* Tool bar icons */
-   defaultPixbufs->up=gtk_icon_theme_load_icon(icon_theme, "go-up", RFM_TOOL_SIZE, 0, NULL);
-   defaultPixbufs->home=gtk_icon_theme_load_icon(icon_theme, "go-home", RFM_TOOL_SIZE, 0, NULL);
-   defaultPixbufs->stop=gtk_icon_theme_load_icon(icon_theme, "process-stop", RFM_TOOL_SIZE, 0, NULL);
-   defaultPixbufs->refresh=gtk_icon_theme_load_icon(icon_theme, "view-refresh", RFM_TOOL_SIZE, 0, NULL);
-   defaultPixbufs->info=gtk_icon_theme_load_icon(icon_theme, "dialog-information", RFM_TOOL_SIZE, 0, NULL);
+   defaultPixbufs->up=icon_cache_theme("go-up", RFM_TOOL_SIZE);
+   defaultPixbufs->home=icon_cache_theme("go-home", RFM_TOOL_SIZE);
+   defaultPixbufs->stop=icon_cache_theme("process-stop", RFM_TOOL_SIZE);
+   defaultPixbufs->refresh=icon_cache_theme("view-refresh", RFM_TOOL_SIZE);
+   defaultPixbufs->info=icon_cache_theme("dialog-information", RFM_TOOL_SIZE);
 
    if (defaultPixbufs->up==NULL) defaultPixbufs->up=gdk_pixbuf_new_from_xpm_data(RFM_icon_up);
    if (defaultPixbufs->home==NULL) defaultPixbufs->home=gdk_pixbuf_new_from_xpm_data(RFM_icon_home);
@@ -704,429 +1361,2952 @@ static void exec_run_action(const char **action, GList *file_list, long n_args,
       g_warning("exec_run_action: %s failed to execute: build_cmd_vector() returned NULL.",action[0]);
 }
 
-/* Load and update a thumbnail from disk cache: key is the md5 hash of the required thumbnail */
-static int load_thumbnail(gchar *key)
+/* RFM_Store: see typedef */
+static void rfm_store_tree_model_init(GtkTreeModelIface *iface);
+static void rfm_store_tree_sortable_init(GtkTreeSortableIface *iface);
+static void rfm_store_drag_source_init(GtkTreeDragSourceIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE(RFM_Store, rfm_store, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_MODEL, rfm_store_tree_model_init)
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_SORTABLE, rfm_store_tree_sortable_init)
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_DRAG_SOURCE, rfm_store_drag_source_init))
+
+#define RFM_STORE(o) ((RFM_Store*)(o))
+#define RFM_STORE_RECORD(s, i) ((RFM_FileAttributes*)g_ptr_array_index((s)->records, (i)))
+#define RFM_STORE_ROW(s, i) g_array_index((s)->rows, guint, (i))
+#define RFM_STORE_ORDER(s, n) g_array_index((s)->order, guint, (n))
+#define RFM_STORE_ITER_RECORD(iter) GPOINTER_TO_UINT((iter)->user_data)
+
+static void rfm_store_init(RFM_Store *store)
 {
-   GtkTreeIter iter;
-   GdkPixbuf *pixbuf=NULL;
-   GtkTreePath *treePath;
-   gchar *thumb_path;
-   const gchar *tmp=NULL;
-   GtkTreeRowReference *reference;
-   gint64 mtime_file=0;
-   gint64 mtime_thumb=1;
+   do store->stamp=g_random_int(); while (store->stamp==0);
+   store->records=g_ptr_array_new();
+   store->order=g_array_new(FALSE, FALSE, sizeof(guint));
+   store->rows=g_array_new(FALSE, FALSE, sizeof(guint));
+   store->names=NULL;
+   store->sort_column_id=GTK_TREE_SORTABLE_DEFAULT_SORT_COLUMN_ID;
+   store->silent=FALSE;
+   store->arenas=g_ptr_array_new_with_free_func((GDestroyNotify)arena_unref);
+   store->arena=NULL;
+   store->n_dead=0;
+}
 
-   reference=g_hash_table_lookup(thumb_hash, key);
-   if (reference==NULL) return 1;  /* Key not found */
+static void rfm_store_finalize(GObject *object)
+{
+   RFM_Store *store=RFM_STORE(object);
+
+   g_ptr_array_foreach(store->records, (GFunc)free_fileAttributes, NULL);
+   g_ptr_array_free(store->records, TRUE);
+   g_array_free(store->order, TRUE);
+   g_array_free(store->rows, TRUE);
+   if (store->names!=NULL)
+      g_hash_table_destroy(store->names);
+   g_ptr_array_free(store->arenas, TRUE);
+   G_OBJECT_CLASS(rfm_store_parent_class)->finalize(object);
+}
 
-   treePath=gtk_tree_row_reference_get_path(reference);
-   if (treePath == NULL)
-      return 1;   /* Tree path not found */
-      
-   gtk_tree_model_get_iter(GTK_TREE_MODEL(store), &iter, treePath);
-   thumb_path=g_build_filename(rfm_thumbDir, key, NULL);
-   pixbuf=gdk_pixbuf_new_from_file(thumb_path, NULL);
-   g_free(thumb_path);
-   if (pixbuf==NULL)
-      return 2;   /* Can't load thumbnail */
-
-   gtk_tree_model_get(GTK_TREE_MODEL(store), &iter, COL_MTIME, &mtime_file, -1);
-   tmp=gdk_pixbuf_get_option(pixbuf, "tEXt::Thumb::MTime");
-   if (tmp!=NULL) mtime_thumb=g_ascii_strtoll(tmp, NULL, 10); /* Convert to gint64 */
-   if (mtime_file!=mtime_thumb) {
-      g_object_unref(pixbuf);
-      return 3;   /* Thumbnail out of date */
-   }
-
-   gtk_list_store_set(store, &iter, COL_PIXBUF, pixbuf, -1);
-   g_object_unref(pixbuf);
-   return 0;
+static void rfm_store_class_init(RFM_StoreClass *klass)
+{
+   G_OBJECT_CLASS(klass)->finalize=rfm_store_finalize;
 }
 
-/* Return the index of a defined thumbnailer which will handle the mime type */
-static gint find_thumbnailer(gchar *mime_root, gchar *mime_sub_type)
+static GtkTreeModelFlags rfm_store_get_flags(GtkTreeModel *model)
 {
-   gint t_idx=-1;
-   gint a_idx=-1;
-   gint i;
-   
-   for(i=0;i<G_N_ELEMENTS(thumbnailers);i++) {   /* Check for user defined thumbnailer */
-      if (strcmp(mime_root, thumbnailers[i].thumbRoot)==0 && strcmp(mime_sub_type, thumbnailers[i].thumbSub)==0) {
-         t_idx=i;
-         break;
-      }
-      if (strcmp(mime_root, thumbnailers[i].thumbRoot)==0 && strncmp("*", thumbnailers[i].thumbSub, 1)==0)
-         a_idx=i;
+   return GTK_TREE_MODEL_LIST_ONLY | GTK_TREE_MODEL_ITERS_PERSIST;
+}
+
+static gint rfm_store_get_n_columns(GtkTreeModel *model)
+{
+   return NUM_COLS;
+}
+
+static GType rfm_store_get_column_type(GtkTreeModel *model, gint index)
+{
+   switch (index) {
+      case COL_DISPLAY_NAME:  return G_TYPE_STRING;
+      case COL_PIXBUF:        return GDK_TYPE_PIXBUF;
+      case COL_MTIME:         return G_TYPE_UINT64;   /* File mtime: time_t is currently 32 bit signed */
+      case COL_ATTR:          return G_TYPE_POINTER;  /* RFM_FileAttributes */
+      default:                return G_TYPE_INVALID;
    }
-   if (t_idx==-1) t_idx=a_idx; /* Maybe we have a generator for all sub types of mimeRoot */
+}
 
-   return t_idx;
+static void rfm_store_set_iter(RFM_Store *store, GtkTreeIter *iter, guint record)
+{
+   iter->stamp=store->stamp;
+   iter->user_data=GUINT_TO_POINTER(record);
 }
 
-static void rfm_saveThumbnail(GdkPixbuf *thumb, RFM_ThumbQueueData *thumbData)
+static gboolean rfm_store_iter_nth_child(GtkTreeModel *model, GtkTreeIter *iter, GtkTreeIter *parent, gint n)
 {
-   GdkPixbuf *thumbAlpha=NULL;
-   gchar *mtime_tmp;
-   gchar *tmp_thumb_file;
-   gchar *thumb_path;
+   RFM_Store *store=RFM_STORE(model);
 
-   thumbAlpha=gdk_pixbuf_add_alpha(thumb, FALSE, 0, 0, 0);  /* Add a transparency channel: some software expects this */
+   if (parent!=NULL || n < 0 || n >= store->order->len)
+      return FALSE;
+   rfm_store_set_iter(store, iter, RFM_STORE_ORDER(store, n));
+   return TRUE;
+}
 
-   if (thumbAlpha!=NULL) {
-      thumb_path=g_build_filename(rfm_thumbDir, thumbData->thumb_name, NULL);
-      tmp_thumb_file=g_strdup_printf("%s-%s-%ld", thumb_path, PROG_NAME, (long)thumbData->rfm_pid); /* check pid_t type: echo | gcc -E -xc -include 'unistd.h' - | grep 'typedef.*pid_t' */
-      mtime_tmp=g_strdup_printf("%"G_GUINT64_FORMAT, thumbData->mtime_file);
-      if (tmp_thumb_file!=NULL && mtime_tmp!=NULL) {
-         gdk_pixbuf_save(thumbAlpha, tmp_thumb_file, "png", NULL,
-            "tEXt::Thumb::MTime", mtime_tmp,
-            "tEXt::Thumb::URI", thumbData->uri,
-            "tEXt::Software", PROG_NAME,
-            NULL);
-         if (chmod(tmp_thumb_file, S_IRUSR | S_IWUSR)==-1)
-            g_warning("rfm_saveThumbnail: Failed to chmod %s\n", tmp_thumb_file);
-         if (rename(tmp_thumb_file, thumb_path)!=0)
-            g_warning("rfm_saveThumbnail: Failed to rename %s\n", tmp_thumb_file);
-      }
-      g_free(thumb_path);
-      g_free(mtime_tmp);
-      g_free(tmp_thumb_file);
-      g_object_unref(thumbAlpha);
+static gboolean rfm_store_get_iter(GtkTreeModel *model, GtkTreeIter *iter, GtkTreePath *path)
+{
+   if (gtk_tree_path_get_depth(path)!=1)
+      return FALSE;
+   return rfm_store_iter_nth_child(model, iter, NULL, gtk_tree_path_get_indices(path)[0]);
+}
+
+static GtkTreePath *rfm_store_get_path(GtkTreeModel *model, GtkTreeIter *iter)
+{
+   RFM_Store *store=RFM_STORE(model);
+
+   g_return_val_if_fail(iter->stamp==store->stamp, NULL);
+   return gtk_tree_path_new_from_indices(RFM_STORE_ROW(store, RFM_STORE_ITER_RECORD(iter)), -1);
+}
+
+static void rfm_store_get_value(GtkTreeModel *model, GtkTreeIter *iter, gint column, GValue *value)
+{
+   RFM_Store *store=RFM_STORE(model);
+   RFM_FileAttributes *fileAttributes;
+
+   g_return_if_fail(iter->stamp==store->stamp);
+   fileAttributes=RFM_STORE_RECORD(store, RFM_STORE_ITER_RECORD(iter));
+   g_value_init(value, rfm_store_get_column_type(model, column));
+   switch (column) {
+      case COL_DISPLAY_NAME:
+         g_value_set_string(value, fileAttributes->display_name);
+      break;
+      case COL_PIXBUF:  /* The thumbnail once loaded */
+         g_value_set_object(value, (fileAttributes->thumbnail!=NULL) ? fileAttributes->thumbnail : fileAttributes->pixbuf);
+      break;
+      case COL_MTIME:
+         g_value_set_uint64(value, fileAttributes->file_mtime);
+      break;
+      case COL_ATTR:
+         g_value_set_pointer(value, fileAttributes);
+      break;
+   }
+}
+
+static gboolean rfm_store_iter_next(GtkTreeModel *model, GtkTreeIter *iter)
+{
+   RFM_Store *store=RFM_STORE(model);
+   guint row=RFM_STORE_ROW(store, RFM_STORE_ITER_RECORD(iter))+1;
+
+   if (row >= store->order->len) {
+      iter->stamp=0;
+      return FALSE;
    }
+   rfm_store_set_iter(store, iter, RFM_STORE_ORDER(store, row));
+   return TRUE;
+}
+
+static gboolean rfm_store_iter_previous(GtkTreeModel *model, GtkTreeIter *iter)
+{
+   RFM_Store *store=RFM_STORE(model);
+   guint row=RFM_STORE_ROW(store, RFM_STORE_ITER_RECORD(iter));
+
+   if (row==0) {
+      iter->stamp=0;
+      return FALSE;
+   }
+   rfm_store_set_iter(store, iter, RFM_STORE_ORDER(store, row-1));
+   return TRUE;
+}
+
+static gboolean rfm_store_iter_children(GtkTreeModel *model, GtkTreeIter *iter, GtkTreeIter *parent)
+{
+   return rfm_store_iter_nth_child(model, iter, parent, 0);
+}
+
+static gboolean rfm_store_iter_has_child(GtkTreeModel *model, GtkTreeIter *iter)
+{
+   return FALSE;
+}
+
+static gint rfm_store_iter_n_children(GtkTreeModel *model, GtkTreeIter *iter)
+{
+   return (iter==NULL) ? RFM_STORE(model)->order->len : 0;
+}
+
+static gboolean rfm_store_iter_parent(GtkTreeModel *model, GtkTreeIter *iter, GtkTreeIter *child)
+{
+   return FALSE;
+}
+
+static void rfm_store_tree_model_init(GtkTreeModelIface *iface)
+{
+   iface->get_flags=rfm_store_get_flags;
+   iface->get_n_columns=rfm_store_get_n_columns;
+   iface->get_column_type=rfm_store_get_column_type;
+   iface->get_iter=rfm_store_get_iter;
+   iface->get_path=rfm_store_get_path;
+   iface->get_value=rfm_store_get_value;
+   iface->iter_next=rfm_store_iter_next;
+   iface->iter_previous=rfm_store_iter_previous;
+   iface->iter_children=rfm_store_iter_children;
+   iface->iter_has_child=rfm_store_iter_has_child;
+   iface->iter_n_children=rfm_store_iter_n_children;
+   iface->iter_nth_child=rfm_store_iter_nth_child;
+   iface->iter_parent=rfm_store_iter_parent;
+}
+
+/* Sort order for the store: modified time; or directories first, then size, extension or mime type if selected,
+ * then filename (see RFM_SORT_COLLATE). Everything compared is in fileAttributes: changing the order needs no I/O.
+ */
+static gint compare_fileAttributes(RFM_FileAttributes *fileAttributesA, RFM_FileAttributes *fileAttributesB, gint sort_column_id)
+{
+   gint cmp=0;
+
+   if (sort_column_id==COL_MTIME) {
+      if (fileAttributesA->file_mtime!=fileAttributesB->file_mtime)
+         return (fileAttributesA->file_mtime > fileAttributesB->file_mtime) ? 1 : -1;
+   }
+   else {
+      if (!fileAttributesA->is_dir && fileAttributesB->is_dir) return 1;
+      if (fileAttributesA->is_dir && !fileAttributesB->is_dir) return -1;
+      switch (sort_column_id) {
+         case RFM_SORT_SIZE:
+            if (fileAttributesA->file_size!=fileAttributesB->file_size)
+               return (fileAttributesA->file_size > fileAttributesB->file_size) ? 1 : -1;
+         break;
+         case RFM_SORT_EXT:   /* No extension first */
+            if (fileAttributesA->extension==NULL || fileAttributesB->extension==NULL)
+               cmp=(fileAttributesA->extension!=NULL) - (fileAttributesB->extension!=NULL);
+            else
+               cmp=g_ascii_strcasecmp(fileAttributesA->extension, fileAttributesB->extension);
+         break;
+         case RFM_SORT_TYPE:  /* Interned strings: usually the same pointer */
+            if (fileAttributesA->mime_root!=fileAttributesB->mime_root)
+               cmp=g_strcmp0(fileAttributesA->mime_root, fileAttributesB->mime_root);
+            if (cmp==0 && fileAttributesA->mime_sub_type!=fileAttributesB->mime_sub_type)
+               cmp=g_strcmp0(fileAttributesA->mime_sub_type, fileAttributesB->mime_sub_type);
+         break;
+      }
+      if (cmp!=0) return cmp;
+   }
+   if (fileAttributesA->collate_key!=NULL && fileAttributesB->collate_key!=NULL) {
+      cmp=strcmp(fileAttributesA->collate_key, fileAttributesB->collate_key);
+      if (cmp!=0) return cmp;
+   }
+   return strcmp(fileAttributesA->file_name, fileAttributesB->file_name);  /* Names that collate equal keep a fixed order */
+}
+
+static gint compare_records(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+   RFM_Store *store=user_data;
+   guint recordA=*(const guint*)a, recordB=*(const guint*)b;
+
+   if (store->sort_column_id==GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID)
+      return (recordA > recordB) - (recordA < recordB);   /* Order added */
+   return compare_fileAttributes(RFM_STORE_RECORD(store, recordA), RFM_STORE_RECORD(store, recordB), store->sort_column_id);
+}
+
+typedef struct {  /* Part of a sort_records() call, run on its own thread */
+   RFM_Store *store;
+   guint *src;
+   guint *dst;       /* NULL: sort src[lo..hi) in place; else merge the sorted runs src[lo..mid) and src[mid..hi) into dst */
+   guint lo, mid, hi;
+} RFM_SortJob;
+
+static gpointer sort_job(RFM_SortJob *job)
+{
+   guint i, j, k;
+
+   if (job->dst==NULL) {
+      g_qsort_with_data(job->src+job->lo, job->hi-job->lo, sizeof(guint), compare_records, job->store);
+      return NULL;
+   }
+   for (i=job->lo, j=job->mid, k=job->lo; i<job->mid || j<job->hi; k++) {
+      if (j==job->hi || (i<job->mid && compare_records(&job->src[i], &job->src[j], job->store) <= 0))
+         job->dst[k]=job->src[i++];  /* Left run first on ties: the sort stays stable */
+      else
+         job->dst[k]=job->src[j++];
+   }
+   return NULL;
+}
+
+/* Run jobs on their own threads, the last one on this thread, and wait for all of them */
+static void run_sort_jobs(RFM_SortJob *jobs, guint n_jobs)
+{
+   GThread *threads[RFM_PSORT_MAX_PARTS];
+   guint i;
+
+   for (i=0; i+1<n_jobs; i++)
+      threads[i]=g_thread_try_new("sort", (GThreadFunc)sort_job, &jobs[i], NULL);
+   sort_job(&jobs[n_jobs-1]);
+   for (i=0; i+1<n_jobs; i++) {
+      if (threads[i]!=NULL)
+         g_thread_join(threads[i]);
+      else
+         sort_job(&jobs[i]);   /* Couldn't start a thread */
+   }
+}
+
+/* Sort an array of record indices for the store's sort order: a stable merge sort. Large arrays are split into one
+ * part per thread (RFM_SORT_THREADS), the parts sorted in parallel and then merged in pairs, also in parallel.
+ * The records are only read, so the threads don't need locks; the caller applies the result to the model.
+ */
+static void sort_records(RFM_Store *store, guint *index, guint n)
+{
+   RFM_SortJob jobs[RFM_PSORT_MAX_PARTS];
+   guint bounds[RFM_PSORT_MAX_PARTS+1];
+   guint n_parts=(RFM_SORT_THREADS > 0) ? RFM_SORT_THREADS : g_get_num_processors();
+   guint *src=index, *dst, *tmp;
+   guint i, width, n_jobs;
+   gint64 start=g_get_monotonic_time();
+
+   n_parts=MIN(n_parts, RFM_PSORT_MAX_PARTS);
+   if (n_parts < 2 || n < RFM_PSORT_MIN) {
+      g_qsort_with_data(index, n, sizeof(guint), compare_records, store);
+      if (n >= RFM_PSORT_MIN)
+         g_debug("sort_records: %u items, 1 thread: %" G_GINT64_FORMAT " us", n, g_get_monotonic_time()-start);
+      return;
+   }
+
+   for (i=0; i<=n_parts; i++)
+      bounds[i]=(guint)((guint64)n*i/n_parts);
+   for (i=0; i<n_parts; i++)
+      jobs[i]=(RFM_SortJob){ store, index, NULL, bounds[i], 0, bounds[i+1] };
+   run_sort_jobs(jobs, n_parts);
+
+   tmp=dst=g_new(guint, n);
+   for (width=1; width<n_parts; width*=2) {
+      for (i=0, n_jobs=0; i<n_parts; i+=2*width, n_jobs++)
+         jobs[n_jobs]=(RFM_SortJob){ store, src, dst, bounds[i], bounds[MIN(i+width, n_parts)], bounds[MIN(i+2*width, n_parts)] };
+      run_sort_jobs(jobs, n_jobs);   /* A run without a partner is copied across by its job */
+      dst=src;
+      src=jobs[0].dst;
+   }
+   if (src!=index)
+      memcpy(index, src, n*sizeof(guint));
+   g_free(tmp);
+   g_debug("sort_records: %u items, %u threads: %" G_GINT64_FORMAT " us", n, n_parts, g_get_monotonic_time()-start);
+}
+
+static gint compare_guint(const void *a, const void *b)
+{
+   return (*(const guint*)a > *(const guint*)b) - (*(const guint*)a < *(const guint*)b);
+}
+
+static void rfm_store_update_rows(RFM_Store *store, guint from_row)
+{
+   guint row;
+
+   g_array_set_size(store->rows, store->records->len);
+   for (row=from_row; row<store->order->len; row++)
+      RFM_STORE_ROW(store, RFM_STORE_ORDER(store, row))=row;
+}
+
+/* Sort the index array, not the records, then tell the view the new order */
+static void rfm_store_sort(RFM_Store *store)
+{
+   gint *new_order;
+   guint row;
+   GtkTreePath *path;
+
+   if (store->order->len < 2)
+      return;
+   sort_records(store, (guint*)store->order->data, store->order->len);
+
+   new_order=g_new(gint, store->order->len);
+   for (row=0; row<store->order->len; row++)
+      new_order[row]=RFM_STORE_ROW(store, RFM_STORE_ORDER(store, row));  /* Old row */
+   rfm_store_update_rows(store, 0);
+   path=gtk_tree_path_new();
+   gtk_tree_model_rows_reordered(GTK_TREE_MODEL(store), path, NULL, new_order);
+   gtk_tree_path_free(path);
+   g_free(new_order);
+}
+
+static gboolean rfm_store_get_sort_column_id(GtkTreeSortable *sortable, gint *sort_column_id, GtkSortType *order)
+{
+   RFM_Store *store=RFM_STORE(sortable);
+
+   if (sort_column_id!=NULL) *sort_column_id=store->sort_column_id;
+   if (order!=NULL) *order=GTK_SORT_ASCENDING;
+   return (store->sort_column_id!=GTK_TREE_SORTABLE_DEFAULT_SORT_COLUMN_ID && store->sort_column_id!=GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID);
+}
+
+static void rfm_store_set_sort_column_id(GtkTreeSortable *sortable, gint sort_column_id, GtkSortType order)
+{
+   RFM_Store *store=RFM_STORE(sortable);
+
+   if (store->sort_column_id==sort_column_id)
+      return;
+   store->sort_column_id=sort_column_id;
+   gtk_tree_sortable_sort_column_changed(sortable);
+   rfm_store_sort(store);
+}
+
+static void rfm_store_set_sort_func(GtkTreeSortable *sortable, gint sort_column_id, GtkTreeIterCompareFunc func, gpointer data, GDestroyNotify destroy)
+{
+   g_warning("rfm_store_set_sort_func: custom sort functions are not supported; see compare_fileAttributes()");
+}
+
+static void rfm_store_set_default_sort_func(GtkTreeSortable *sortable, GtkTreeIterCompareFunc func, gpointer data, GDestroyNotify destroy)
+{
+   rfm_store_set_sort_func(sortable, GTK_TREE_SORTABLE_DEFAULT_SORT_COLUMN_ID, func, data, destroy);
+}
+
+static gboolean rfm_store_has_default_sort_func(GtkTreeSortable *sortable)
+{
+   return TRUE;
+}
+
+static void rfm_store_tree_sortable_init(GtkTreeSortableIface *iface)
+{
+   iface->get_sort_column_id=rfm_store_get_sort_column_id;
+   iface->set_sort_column_id=rfm_store_set_sort_column_id;
+   iface->set_sort_func=rfm_store_set_sort_func;
+   iface->set_default_sort_func=rfm_store_set_default_sort_func;
+   iface->has_default_sort_func=rfm_store_has_default_sort_func;
+}
+
+/* Needed for gtk_icon_view_enable_model_drag_source(): drag data itself is set by drag_data_get_handl() */
+static gboolean rfm_store_row_draggable(GtkTreeDragSource *drag_source, GtkTreePath *path)
+{
+   return TRUE;
+}
+
+static gboolean rfm_store_drag_data_get(GtkTreeDragSource *drag_source, GtkTreePath *path, GtkSelectionData *selection_data)
+{
+   return gtk_tree_set_row_drag_data(selection_data, GTK_TREE_MODEL(drag_source), path);
+}
+
+static gboolean rfm_store_drag_data_delete(GtkTreeDragSource *drag_source, GtkTreePath *path)
+{
+   return FALSE;
+}
+
+static void rfm_store_drag_source_init(GtkTreeDragSourceIface *iface)
+{
+   iface->row_draggable=rfm_store_row_draggable;
+   iface->drag_data_get=rfm_store_drag_data_get;
+   iface->drag_data_delete=rfm_store_drag_data_delete;
+}
+
+static RFM_Store *rfm_store_new(void)
+{
+   return g_object_new(rfm_store_get_type(), NULL);
+}
+
+/* Keep a reference to the arena holding records added to the store */
+static void rfm_store_add_arena(RFM_Store *store, RFM_Arena *arena)
+{
+   guint i;
+
+   for (i=0; i<store->arenas->len; i++)
+      if (g_ptr_array_index(store->arenas, i)==arena)
+         return;
+   g_ptr_array_add(store->arenas, arena_ref(arena));
+}
+
+/* Arena for records made on the main thread, e.g. by inotify_insert_item() */
+static RFM_Arena *rfm_store_arena(RFM_Store *store)
+{
+   if (store->arena==NULL) {
+      store->arena=arena_new();
+      g_ptr_array_add(store->arenas, store->arena);   /* Takes the reference */
+   }
+   return store->arena;
+}
+
+/* Add items to the store, taking ownership: items is left empty. The new records are sorted on their own and
+ * merged into the row order in one pass. Returns the record index of the first item added: new items are the
+ * records from there to the end.
+ */
+static guint rfm_store_append(RFM_Store *store, GPtrArray *items)
+{
+   guint first=store->records->len;
+   guint n_old=store->order->len;
+   guint n_new=items->len;
+   guint *added, *merged;
+   guint i, j, row;
+   GtkTreeIter iter;
+   GtkTreePath *path;
+
+   if (n_new==0)
+      return first;
+   for (i=0; i<n_new; i++) {
+      g_ptr_array_add(store->records, g_ptr_array_index(items, i));
+      if (store->names!=NULL)
+         g_hash_table_replace(store->names, RFM_STORE_RECORD(store, first+i)->file_name, GUINT_TO_POINTER(first+i));
+   }
+   g_ptr_array_set_size(items, 0);
+
+   added=g_new(guint, n_new);
+   for (i=0; i<n_new; i++)
+      added[i]=first+i;
+   sort_records(store, added, n_new);
+
+   merged=g_new(guint, n_old+n_new);
+   for (i=0, j=0, row=0; i<n_old || j<n_new; row++) {
+      if (j==n_new || (i<n_old && compare_records(&RFM_STORE_ORDER(store, i), &added[j], store) <= 0))
+         merged[row]=RFM_STORE_ORDER(store, i++);
+      else
+         merged[row]=added[j++];
+   }
+   g_array_set_size(store->order, 0);
+   g_array_append_vals(store->order, merged, n_old+n_new);
+   rfm_store_update_rows(store, 0);
+   g_free(merged);
+
+   if (store->silent) {
+      g_free(added);
+      return first;
+   }
+
+   /* Announce new rows in row order, as if they had been inserted one at a time */
+   for (j=0; j<n_new; j++)
+      added[j]=RFM_STORE_ROW(store, first+j);
+   qsort(added, n_new, sizeof(guint), compare_guint);
+   for (j=0; j<n_new; j++) {
+      rfm_store_set_iter(store, &iter, RFM_STORE_ORDER(store, added[j]));
+      path=gtk_tree_path_new_from_indices(added[j], -1);
+      gtk_tree_model_row_inserted(GTK_TREE_MODEL(store), path, &iter);
+      gtk_tree_path_free(path);
+   }
+   g_free(added);
+   return first;
+}
+
+/* Tell the view a record has changed, e.g. when its thumbnail is loaded */
+static void rfm_store_row_changed(RFM_Store *store, GtkTreeIter *iter)
+{
+   GtkTreePath *path=rfm_store_get_path(GTK_TREE_MODEL(store), iter);
+
+   gtk_tree_model_row_changed(GTK_TREE_MODEL(store), path, iter);
+   gtk_tree_path_free(path);
+}
+
+/* Move one record's row to its sort position, found by a binary search of the other rows, then tell the view */
+static void rfm_store_move(RFM_Store *store, guint record)
+{
+   guint row=RFM_STORE_ROW(store, record);
+   guint n_rows=store->order->len;
+   guint lo=0, hi=n_rows-1, mid, i;
+   gint *new_order;
+   GtkTreePath *path;
+
+   g_array_remove_index(store->order, row);
+   while (lo < hi) {
+      mid=lo+(hi-lo)/2;
+      if (compare_records(&record, &RFM_STORE_ORDER(store, mid), store) < 0)
+         hi=mid;
+      else
+         lo=mid+1;
+   }
+   g_array_insert_val(store->order, lo, record);
+   rfm_store_update_rows(store, MIN(row, lo));
+
+   new_order=g_new(gint, n_rows);
+   for (i=0; i<n_rows; i++)
+      new_order[i]=i;   /* Old row */
+   for (i=lo+1; i<=row; i++)   /* Moved up: rows between move down one */
+      new_order[i]=i-1;
+   for (i=row; i<lo; i++)      /* Moved down: rows between move up one */
+      new_order[i]=i+1;
+   new_order[lo]=row;
+   path=gtk_tree_path_new();
+   gtk_tree_model_rows_reordered(GTK_TREE_MODEL(store), path, NULL, new_order);
+   gtk_tree_path_free(path);
+   g_free(new_order);
+}
+
+/* The record at iter has been changed in place: the row is moved if its sort position has changed */
+static void rfm_store_changed(RFM_Store *store, GtkTreeIter *iter)
+{
+   guint record=RFM_STORE_ITER_RECORD(iter);
+   guint row=RFM_STORE_ROW(store, record);
+   guint n_rows=store->order->len;
+
+   if ((row > 0 && compare_records(&RFM_STORE_ORDER(store, row-1), &record, store) > 0)
+         || (row+1 < n_rows && compare_records(&record, &RFM_STORE_ORDER(store, row+1), store) > 0)) {
+      if (store->silent)
+         store->unsorted=TRUE;   /* Many may change: sort once */
+      else
+         rfm_store_move(store, record);
+   }
+   rfm_store_row_changed(store, iter);
+}
+
+/* Replace the record at iter, releasing the old one (its memory stays in its arena); the row is moved if its sort position has changed */
+static void rfm_store_replace(RFM_Store *store, GtkTreeIter *iter, RFM_FileAttributes *fileAttributes)
+{
+   guint record=RFM_STORE_ITER_RECORD(iter);
+
+   free_fileAttributes(RFM_STORE_RECORD(store, record));
+   g_ptr_array_index(store->records, record)=fileAttributes;
+   store->n_dead++;
+   if (store->names!=NULL)
+      g_hash_table_replace(store->names, fileAttributes->file_name, GUINT_TO_POINTER(record));
+   rfm_store_changed(store, iter);
+}
+
+/* Remove the rows of many records in one pass over the row order, without row signals: the view must be detached */
+static void rfm_store_remove_records(RFM_Store *store, GArray *records)
+{
+   RFM_FileAttributes *fileAttributes;
+   guint record, row, n_rows=0;
+   guint i;
+
+   for (i=0; i<records->len; i++) {
+      record=g_array_index(records, guint, i);
+      fileAttributes=RFM_STORE_RECORD(store, record);
+      if (store->names!=NULL)
+         g_hash_table_remove(store->names, fileAttributes->file_name);
+      free_fileAttributes(fileAttributes);
+      g_ptr_array_index(store->records, record)=NULL;
+      store->n_dead++;
+   }
+   for (row=0; row<store->order->len; row++) {
+      record=RFM_STORE_ORDER(store, row);
+      if (RFM_STORE_RECORD(store, record)!=NULL)
+         RFM_STORE_ORDER(store, n_rows++)=record;
+   }
+   g_array_set_size(store->order, n_rows);
+   rfm_store_update_rows(store, 0);
+}
+
+/* Remove the row at iter. The record is set to NULL rather than taken out of the array, so other iters stay valid */
+static void rfm_store_remove(RFM_Store *store, GtkTreeIter *iter)
+{
+   guint record=RFM_STORE_ITER_RECORD(iter);
+   guint row=RFM_STORE_ROW(store, record);
+   GtkTreePath *path=gtk_tree_path_new_from_indices(row, -1);
+
+   if (store->names!=NULL)
+      g_hash_table_remove(store->names, RFM_STORE_RECORD(store, record)->file_name);
+   free_fileAttributes(RFM_STORE_RECORD(store, record));
+   g_ptr_array_index(store->records, record)=NULL;
+   store->n_dead++;
+   g_array_remove_index(store->order, row);
+   rfm_store_update_rows(store, row);
+   gtk_tree_model_row_deleted(GTK_TREE_MODEL(store), path);
+   gtk_tree_path_free(path);
+}
+
+/* Find the item called name: the name index is built on the first call after the store is filled, then kept
+ * up to date by rfm_store_append(), rfm_store_replace() and rfm_store_remove()
+ */
+static gboolean rfm_store_lookup(RFM_Store *store, const gchar *name, GtkTreeIter *iter)
+{
+   gpointer record;
+   guint i;
+
+   if (store->names==NULL) {
+      store->names=g_hash_table_new(g_str_hash, g_str_equal);
+      for (i=0; i<store->records->len; i++)
+         if (RFM_STORE_RECORD(store, i)!=NULL)
+            g_hash_table_insert(store->names, RFM_STORE_RECORD(store, i)->file_name, GUINT_TO_POINTER(i));
+   }
+   if (!g_hash_table_lookup_extended(store->names, name, NULL, &record))
+      return FALSE;
+   rfm_store_set_iter(store, iter, GPOINTER_TO_UINT(record));
+   return TRUE;
+}
+
+/* Take all records out of the store, e.g. for the directory cache; the caller also gets the references to their arenas */
+static GPtrArray *rfm_store_steal_all(RFM_Store *store, GPtrArray **arenas)
+{
+   GPtrArray *records=store->records;
+   GtkTreePath *path=gtk_tree_path_new_from_indices(0, -1);
+   guint n_rows=store->order->len;
+   guint i, j;
+
+   for (i=0, j=0; i<records->len; i++)   /* Drop removed items */
+      if (g_ptr_array_index(records, i)!=NULL)
+         g_ptr_array_index(records, j++)=g_ptr_array_index(records, i);
+   g_ptr_array_set_size(records, j);
+   if (store->names!=NULL) {
+      g_hash_table_destroy(store->names);
+      store->names=NULL;
+   }
+
+   *arenas=store->arenas;
+   store->arenas=g_ptr_array_new_with_free_func((GDestroyNotify)arena_unref);
+   store->arena=NULL;
+   store->n_dead=0;
+   store->records=g_ptr_array_new();
+   g_array_set_size(store->order, 0);
+   g_array_set_size(store->rows, 0);
+   while (!store->silent && n_rows-- > 0)   /* Like gtk_list_store_clear(): remove the first row until empty */
+      gtk_tree_model_row_deleted(GTK_TREE_MODEL(store), path);
+   gtk_tree_path_free(path);
+   do store->stamp=g_random_int(); while (store->stamp==0);  /* Existing iters are invalid */
+   return records;
+}
+
+/* Frees all records at once by dropping the arenas */
+static void rfm_store_clear(RFM_Store *store)
+{
+   GPtrArray *arenas;
+   GPtrArray *records=rfm_store_steal_all(store, &arenas);
+
+   g_ptr_array_foreach(records, (GFunc)free_fileAttributes, NULL);
+   g_ptr_array_free(records, TRUE);
+   g_ptr_array_free(arenas, TRUE);
+}
+
+/* Removed and replaced records stay in the records array and their arenas: copy the live records into one new
+ * arena, renumbering them in row order, and drop the old arenas. Rows don't change but record indices do, so
+ * existing iters are invalidated, against the model's ITERS_PERSIST flag: the view must be detached, and the caller
+ * must renumber any record indices it keeps, using the returned array (old record index to new, G_MAXUINT for
+ * removed records; free with g_free()).
+ */
+static guint *rfm_store_compact(RFM_Store *store)
+{
+   guint *remap=g_new(guint, store->records->len);
+   GPtrArray *records=g_ptr_array_sized_new(store->order->len);
+   RFM_Arena *arena=arena_new();
+   guint record, row;
+
+   for (record=0; record<store->records->len; record++)
+      remap[record]=G_MAXUINT;
+   for (row=0; row<store->order->len; row++) {
+      record=RFM_STORE_ORDER(store, row);
+      remap[record]=row;
+      g_ptr_array_add(records, copy_fileAttributes(arena, RFM_STORE_RECORD(store, record)));
+      RFM_STORE_ORDER(store, row)=row;
+   }
+   g_ptr_array_free(store->records, TRUE);   /* The copies took the pixbufs */
+   store->records=records;
+   rfm_store_update_rows(store, 0);
+   if (store->names!=NULL) {   /* Keys were in the old arenas */
+      g_hash_table_destroy(store->names);
+      store->names=NULL;
+   }
+   g_ptr_array_set_size(store->arenas, 0);
+   g_ptr_array_add(store->arenas, arena);   /* Takes the reference */
+   store->arena=arena;
+   store->n_dead=0;
+   do store->stamp=g_random_int(); while (store->stamp==0);  /* Existing iters are invalid */
+   return remap;
+}
+
+static void free_thumbLoad(RFM_ThumbLoad *load)
+{
+   g_free(load->thumb_name);
+   g_free(load->path);
+   g_free(load->uri);
+   if (load->pixbuf!=NULL)
+      g_object_unref(load->pixbuf);
+   free(load);
+}
+
+static guint32 png_uint32(const guchar *p)
+{
+   return (guint32)p[0]<<24 | (guint32)p[1]<<16 | (guint32)p[2]<<8 | p[3];
+}
+
+/* Check a cached thumbnail without decoding it: only the chunks before the image data are read. Thumb::MTime must
+ * match; Thumb::URI must match if present and uri is not NULL.
+ */
+static gboolean thumb_png_valid(const gchar *thumb_path, const gchar *uri, guint64 mtime)
+{
+   guchar header[8];
+   gchar text[RFM_PNG_TEXT_MAX+1];
+   gchar *value;
+   guint32 length;
+   gboolean mtime_ok=FALSE, uri_ok=TRUE;
+   int fd;
+
+   fd=open(thumb_path, O_RDONLY | O_CLOEXEC);
+   if (fd==-1)
+      return FALSE;
+   if (read(fd, header, 8)==8 && memcmp(header, "\211PNG\r\n\032\n", 8)==0) {
+      while (read(fd, header, 8)==8) {   /* Chunk length and type */
+         length=png_uint32(header);
+         if (memcmp(header+4, "IDAT", 4)==0 || memcmp(header+4, "IEND", 4)==0)
+            break;
+         if (memcmp(header+4, "tEXt", 4)==0 && length<=RFM_PNG_TEXT_MAX) {
+            if (read(fd, text, length)!=length)
+               break;
+            text[length]='\0';
+            value=memchr(text, '\0', length);   /* Keyword, NUL, text */
+            if (value!=NULL && strcmp(text, "Thumb::MTime")==0)
+               mtime_ok=(g_ascii_strtoull(value+1, NULL, 10)==mtime);
+            else if (value!=NULL && uri!=NULL && strcmp(text, "Thumb::URI")==0)
+               uri_ok=(strcmp(value+1, uri)==0);
+            length=0;
+         }
+         if (lseek(fd, (off_t)length+4, SEEK_CUR)==-1)   /* Skip the data and CRC */
+            break;
+      }
+   }
+   close(fd);
+   return mtime_ok && uri_ok;
+}
+
+/* rfm_thumbLoadPool thread: decode a cached thumbnail once its header shows it is for this version of the file */
+static void thumb_load(RFM_ThumbLoad *load, gpointer user_data)
+{
+   gchar *thumb_path;
+
+   if (g_atomic_int_get(&rfm_thumbGeneration)==load->generation) {
+      thumb_path=g_build_filename(rfm_thumbDir, load->thumb_name, NULL);
+      if (thumb_png_valid(thumb_path, load->uri, load->mtime))
+         load->pixbuf=gdk_pixbuf_new_from_file(thumb_path, NULL);
+      g_free(thumb_path);
+   }
+   g_async_queue_push(rfm_thumbLoaded, load);
+}
+
+/* Hand waiting requests to rfm_thumbLoadPool, keeping at most RFM_THUMB_LOADS_MAX there or loaded and not shown */
+static void thumb_load_dispatch(void)
+{
+   RFM_ThumbLoad *load;
+
+   while (rfm_thumbLoadsInPool < RFM_THUMB_LOADS_MAX && (load=g_queue_pop_head(&rfm_thumbLoadWaiting))!=NULL) {
+      rfm_thumbLoadsInPool++;
+      g_thread_pool_push(rfm_thumbLoadPool, load, NULL);
+   }
+}
+
+/* Main thread, every RFM_THUMB_FRAME_INTERVAL while loads are pending: show the thumbnails thumb_load() has finished,
+ * for up to RFM_THUMB_FRAME_TIME. Jobs that found no valid thumbnail are queued to be made.
+ */
+static gboolean thumb_loaded_show(gpointer user_data)
+{
+   RFM_ThumbLoad *load;
+   RFM_ThumbQueueData *thumbData;
+   RFM_FileAttributes *fileAttributes;
+   GtkTreeIter iter;
+   GList *newQueue=NULL;
+   gboolean loaded;
+   gint64 start=g_get_monotonic_time();
+
+   while (rfm_thumbLoadsPending > 0 && g_get_monotonic_time()-start < RFM_THUMB_FRAME_TIME
+          && (load=g_async_queue_try_pop(rfm_thumbLoaded))!=NULL) {
+      rfm_thumbLoadsPending--;
+      rfm_thumbLoadsInPool--;
+      if (load->generation!=g_atomic_int_get(&rfm_thumbGeneration)) {   /* Stopped, or directory changed */
+         free_thumbLoad(load);
+         continue;
+      }
+      fileAttributes=(load->record < store->records->len) ? RFM_STORE_RECORD(store, load->record) : NULL;
+      loaded=(load->pixbuf!=NULL && fileAttributes!=NULL && fileAttributes->file_mtime==load->mtime);
+      if (loaded) {
+         g_clear_object(&(fileAttributes->thumbnail));
+         fileAttributes->thumbnail=load->pixbuf;   /* Takes the reference */
+         load->pixbuf=NULL;
+         rfm_store_set_iter(store, &iter, load->record);
+         rfm_store_row_changed(store, &iter);
+      }
+      thumbData=load->forJob ? g_hash_table_lookup(rfm_thumbJobs, load->path) : NULL;
+      if (thumbData!=NULL && thumbData->state==RFM_THUMB_LOADING) {
+         if (fileAttributes!=NULL && ((!loaded && load->make) || thumbData->mtime_wanted!=thumbData->mtime_file)) {
+            thumbData->mtime_file=thumbData->mtime_wanted;
+            thumbData->state=RFM_THUMB_QUEUED;
+            newQueue=g_list_prepend(newQueue, thumbData);
+         }
+         else
+            thumbData->state=RFM_THUMB_DONE;
+      }
+      free_thumbLoad(load);
+   }
+   if (newQueue!=NULL) {
+      rfm_thumbQueue=g_list_concat(rfm_thumbQueue, g_list_reverse(newQueue));
+      schedule_thumbs();
+   }
+   thumb_load_dispatch();
+   if (rfm_thumbLoadsPending > 0)
+      return G_SOURCE_CONTINUE;
+   rfm_thumbLoadTimer=0;
+   compact_store();   /* Put off while loads were pending */
+   return G_SOURCE_REMOVE;
+}
+
+/* Read a thumbnail from the disk cache in rfm_thumbLoadPool and show it for the record (see thumb_loaded_show()) */
+static void thumb_load_request(guint record, const gchar *thumb_name, const gchar *path, const gchar *uri, guint64 mtime, gboolean forJob, gboolean make)
+{
+   RFM_ThumbLoad *load;
+
+   load=malloc(sizeof(RFM_ThumbLoad));
+   if (load==NULL) return;
+   load->thumb_name=g_strdup(thumb_name);
+   load->path=g_strdup(path);
+   load->uri=g_strdup(uri);
+   load->mtime=mtime;
+   load->record=record;
+   load->generation=g_atomic_int_get(&rfm_thumbGeneration);
+   load->forJob=forJob;
+   load->make=make;
+   load->pixbuf=NULL;
+   rfm_thumbLoadsPending++;
+   g_queue_push_tail(&rfm_thumbLoadWaiting, load);
+   thumb_load_dispatch();
+   if (rfm_thumbLoadTimer==0)
+      rfm_thumbLoadTimer=g_timeout_add(RFM_THUMB_FRAME_INTERVAL, thumb_loaded_show, NULL);
+}
+
+/* Load and update a thumbnail from disk cache: key is the md5 hash of the required thumbnail. Used for thumbnails
+ * saved to rfm_thumbDir while the directory is shown.
+ */
+static void load_thumbnail(gchar *key)
+{
+   gpointer record;
+   RFM_FileAttributes *fileAttributes;
+   RFM_ThumbQueueData *thumbData;
+
+   if (!g_hash_table_lookup_extended(thumb_hash, key, NULL, &record) || RFM_STORE_RECORD(store, GPOINTER_TO_UINT(record))==NULL)
+      return;  /* Key not found, or item removed */
+
+   fileAttributes=RFM_STORE_RECORD(store, GPOINTER_TO_UINT(record));
+   thumbData=g_hash_table_lookup(rfm_thumbJobs, fileAttributes->path);
+   thumb_load_request(GPOINTER_TO_UINT(record), key, fileAttributes->path, thumbData!=NULL ? thumbData->uri : NULL,
+                      fileAttributes->file_mtime, FALSE, FALSE);
+}
+
+/* Main thread: take the names read by thumb_index_thread(). Thumbnails added while it ran, seen by inotify_handler(),
+ * are kept; any removed may be left in: that only costs a failed open in thumb_load().
+ */
+static gboolean thumb_index_ready(gpointer user_data)
+{
+   GThread *thread=user_data;
+   GHashTable *names=g_thread_join(thread);
+   GHashTableIter iter;
+   gpointer name;
+
+   rfm_thumbIndexReading=FALSE;
+   if (names==NULL)
+      return FALSE;   /* Not readable: thumbnails are looked for in rfm_thumbDir */
+   g_hash_table_iter_init(&iter, rfm_thumbIndex);
+   while (g_hash_table_iter_next(&iter, &name, NULL)) {
+      g_hash_table_iter_steal(&iter);
+      g_hash_table_add(names, name);
+   }
+   g_hash_table_destroy(rfm_thumbIndex);
+   rfm_thumbIndex=names;
+   if (rfm_thumbIndexStale)
+      thumb_index_start();
+   else if (rfm_thumbnail_wd >= 0)   /* Not kept up to date without the watch */
+      rfm_thumbIndexReady=TRUE;
+   return FALSE;
+}
+
+/* Thread: one pass over rfm_thumbDir instead of trying to open each item's thumbnail in turn. Returns the names to
+ * thumb_index_ready() through g_thread_join().
+ */
+static gpointer thumb_index_thread(gpointer user_data)
+{
+   gchar *thumbDir=user_data;   /* A copy: the thread may outlive rfm_thumbDir at exit */
+   GHashTable *names=g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+   DIR *dir;
+   struct dirent *de;
+
+   dir=opendir(thumbDir);
+   g_free(thumbDir);
+   if (dir==NULL) {
+      g_hash_table_destroy(names);
+      names=NULL;
+   }
+   else {
+      while ((de=readdir(dir))!=NULL) {
+         if (de->d_name[0]!='.' && g_str_has_suffix(de->d_name, ".png"))
+            g_hash_table_add(names, g_strdup(de->d_name));
+      }
+      closedir(dir);
+   }
+   g_idle_add(thumb_index_ready, g_thread_self());
+   return names;
+}
+
+/* (Re)build rfm_thumbIndex in the background; it is kept up to date by the rfm_thumbnail_wd inotify watch */
+static void thumb_index_start(void)
+{
+   GThread *thread;
+
+   rfm_thumbIndexReady=FALSE;
+   if (rfm_thumbIndexReading) {
+      rfm_thumbIndexStale=TRUE;   /* Read again by thumb_index_ready() */
+      return;
+   }
+   rfm_thumbIndexStale=FALSE;
+   g_hash_table_remove_all(rfm_thumbIndex);
+   thread=g_thread_try_new("thumbIndex", thumb_index_thread, g_strdup(rfm_thumbDir), NULL);
+   rfm_thumbIndexReading=(thread!=NULL);
+}
+
+/* Return the index of a defined thumbnailer which will handle the mime type */
+static gint find_thumbnailer(const gchar *mime_root, const gchar *mime_sub_type)
+{
+   gint t_idx=-1;
+   gint a_idx=-1;
+   gint i;
+   
+   for(i=0;i<G_N_ELEMENTS(thumbnailers);i++) {   /* Check for user defined thumbnailer */
+      if (strcmp(mime_root, thumbnailers[i].thumbRoot)==0 && strcmp(mime_sub_type, thumbnailers[i].thumbSub)==0) {
+         t_idx=i;
+         break;
+      }
+      if (strcmp(mime_root, thumbnailers[i].thumbRoot)==0 && strncmp("*", thumbnailers[i].thumbSub, 1)==0)
+         a_idx=i;
+   }
+   if (t_idx==-1) t_idx=a_idx; /* Maybe we have a generator for all sub types of mimeRoot */
+
+   return t_idx;
+}
+
+static void rfm_saveThumbnail(GdkPixbuf *thumb, RFM_ThumbQueueData *thumbData)
+{
+   GdkPixbuf *thumbAlpha=NULL;
+   gchar *mtime_tmp;
+   gchar *tmp_thumb_file;
+   gchar *thumb_path;
+
+   thumbAlpha=gdk_pixbuf_add_alpha(thumb, FALSE, 0, 0, 0);  /* Add a transparency channel: some software expects this */
+
+   if (thumbAlpha!=NULL) {
+      thumb_path=g_build_filename(rfm_thumbDir, thumbData->thumb_name, NULL);
+      /* pid and thread make the temporary name unique: check pid_t type: echo | gcc -E -xc -include 'unistd.h' - | grep 'typedef.*pid_t' */
+      tmp_thumb_file=g_strdup_printf("%s-%s-%ld-%p", thumb_path, PROG_NAME, (long)thumbData->rfm_pid, (void*)g_thread_self());
+      mtime_tmp=g_strdup_printf("%"G_GUINT64_FORMAT, thumbData->mtime_file);
+      if (tmp_thumb_file!=NULL && mtime_tmp!=NULL) {
+         gdk_pixbuf_save(thumbAlpha, tmp_thumb_file, "png", NULL,
+            "tEXt::Thumb::MTime", mtime_tmp,
+            "tEXt::Thumb::URI", thumbData->uri,
+            "tEXt::Software", PROG_NAME,
+            NULL);
+         if (chmod(tmp_thumb_file, S_IRUSR | S_IWUSR)==-1)
+            g_warning("rfm_saveThumbnail: Failed to chmod %s\n", tmp_thumb_file);
+         if (rename(tmp_thumb_file, thumb_path)!=0)
+            g_warning("rfm_saveThumbnail: Failed to rename %s\n", tmp_thumb_file);
+      }
+      g_free(thumb_path);
+      g_free(mtime_tmp);
+      g_free(tmp_thumb_file);
+      g_object_unref(thumbAlpha);
+   }
+}
+
+static gint thumb_compare(gconstpointer a, gconstpointer b)
+{
+   guint pa=((const RFM_ThumbQueueData*)a)->priority;
+   guint pb=((const RFM_ThumbQueueData*)b)->priority;
+
+   return (pa > pb) - (pa < pb);
+}
+
+/* The item a job is for; NULL if it has been removed */
+static RFM_FileAttributes *thumb_item(RFM_ThumbQueueData *thumbData)
+{
+   if (thumbData->record >= store->records->len)
+      return NULL;   /* Removed before the store was compacted */
+   return RFM_STORE_RECORD(store, thumbData->record);
+}
+
+static void thumb_job_drop(RFM_ThumbQueueData *thumbData)
+{
+   g_hash_table_remove(rfm_thumbJobs, thumbData->path);
+   free_thumbQueueData(thumbData);
+}
+
+/* Hand thumbnails queued in rfm_thumbQueue to rfm_thumbPool. Only a few more than there are threads are handed over
+ * at a time, so the rest of the queue can still be dropped by rfm_stop_all(). Main thread only.
+ */
+static void thumb_dispatch(void)
+{
+   RFM_ThumbQueueData *thumbData;
+   gint64 elapsed;
+
+   while (rfm_thumbQueue!=NULL && rfm_thumbsInFlight < rfm_thumbsMaxInFlight) {
+      if (rfm_thumbsInFlight==0 && rfm_thumbsMade==0)
+         rfm_thumbsStart=g_get_monotonic_time();
+      thumbData=rfm_thumbQueue->data;
+      rfm_thumbQueue=g_list_delete_link(rfm_thumbQueue, rfm_thumbQueue);
+      if (thumb_item(thumbData)==NULL) {   /* Item removed */
+         thumb_job_drop(thumbData);
+         continue;
+      }
+      thumbData->generation=g_atomic_int_get(&rfm_thumbGeneration);
+      thumbData->cancelled=FALSE;
+      thumbData->made=FALSE;
+      thumbData->state=RFM_THUMB_RUNNING;
+      rfm_thumbsInFlight++;
+      rfm_thumbsRunning=g_list_prepend(rfm_thumbsRunning, thumbData);
+      g_thread_pool_push(rfm_thumbPool, thumbData, NULL);
+   }
+   if (rfm_thumbQueue==NULL && rfm_thumbsInFlight==0 && rfm_thumbsMade > 0) {
+      elapsed=MAX(g_get_monotonic_time()-rfm_thumbsStart, 1);
+      g_debug("%u thumbnails in %" G_GINT64_FORMAT " ms: %.1f per second",
+              rfm_thumbsMade, elapsed/1000, rfm_thumbsMade*1000000.0/elapsed);
+      rfm_thumbsMade=0;
+   }
+}
+
+/* Main thread: a job is back from mkThumb(). Finished jobs stay in rfm_thumbJobs, so asking again for the same
+ * file and mtime doesn't make the thumbnail again (see get_thumbData()).
+ */
+static gboolean thumb_done(gpointer user_data)
+{
+   RFM_ThumbQueueData *thumbData=user_data;
+
+   rfm_thumbsInFlight--;
+   rfm_thumbsRunning=g_list_remove(rfm_thumbsRunning, thumbData);
+   if (thumbData->generation!=g_atomic_int_get(&rfm_thumbGeneration))
+      free_thumbQueueData(thumbData);   /* Already removed from rfm_thumbJobs by rfm_stop_all() */
+   else {
+      if (thumbData->made)
+         rfm_thumbsMade++;
+      if (thumbData->mtime_wanted!=thumbData->mtime_file || (!thumbData->made && g_atomic_int_get(&thumbData->cancelled))) {
+         thumbData->mtime_file=thumbData->mtime_wanted;
+         thumbData->state=RFM_THUMB_QUEUED;
+         rfm_thumbQueue=g_list_insert_sorted(rfm_thumbQueue, thumbData, thumb_compare);   /* Made later, when its turn comes */
+      }
+      else
+         thumbData->state=RFM_THUMB_DONE;
+   }
+   thumb_dispatch();
+   return FALSE;
+}
+
+/* Rows between the row and the visible range */
+static guint thumb_distance(guint record, gint first, gint last)
+{
+   gint row=(gint)RFM_STORE_ROW(store, record);
+
+   if (row < first) return first-row;
+   if (row > last) return row-last;
+   return 0;
+}
+
+/* Order the queue so that thumbnails in view are made first, then those within RFM_VIEW_MARGIN rows of the view
+ * (made ahead of scrolling), then the rest nearest first. Jobs already handed to rfm_thumbPool for rows now further
+ * away than that are cancelled if anything nearer is waiting: those not started yet are skipped by mkThumb() and put
+ * back in the queue by thumb_done(). Run at idle priority, scheduled by schedule_thumbs() when thumbnails are queued
+ * or the view scrolls or changes size.
+ */
+static gboolean thumb_prioritise(gpointer user_data)
+{
+   GtkTreePath *startPath=NULL, *endPath=NULL;
+   RFM_ThumbQueueData *thumbData;
+   GList *listElement, *next;
+   gint first=0, last=0;
+
+   rfm_thumbPrioritiser=0;
+   if (gtk_icon_view_get_visible_range(GTK_ICON_VIEW(icon_view), &startPath, &endPath)) {
+      first=gtk_tree_path_get_indices(startPath)[0];
+      last=gtk_tree_path_get_indices(endPath)[0];
+      gtk_tree_path_free(startPath);
+      gtk_tree_path_free(endPath);
+   }
+
+   for (listElement=rfm_thumbQueue; listElement!=NULL; listElement=next) {
+      next=g_list_next(listElement);
+      thumbData=listElement->data;
+      if (thumb_item(thumbData)==NULL) {   /* Item removed */
+         rfm_thumbQueue=g_list_delete_link(rfm_thumbQueue, listElement);
+         thumb_job_drop(thumbData);
+      }
+      else
+         thumbData->priority=thumb_distance(thumbData->record, first, last);
+   }
+   rfm_thumbQueue=g_list_sort(rfm_thumbQueue, thumb_compare);   /* Stable: rows of equal priority stay in view order */
+
+   if (rfm_thumbQueue!=NULL && ((RFM_ThumbQueueData*)rfm_thumbQueue->data)->priority <= RFM_VIEW_MARGIN) {
+      for (listElement=rfm_thumbsRunning; listElement!=NULL; listElement=g_list_next(listElement)) {
+         thumbData=listElement->data;
+         if (thumb_item(thumbData)==NULL || thumb_distance(thumbData->record, first, last) > RFM_VIEW_MARGIN) {
+            thumbData->priority=G_MAXUINT;
+            g_atomic_int_set(&thumbData->cancelled, TRUE);
+         }
+      }
+   }
+   thumb_dispatch();
+   return FALSE;
+}
+
+static void schedule_thumbs(void)
+{
+   if (rfm_thumbPrioritiser==0 && rfm_thumbPool!=NULL)
+      rfm_thumbPrioritiser=g_idle_add(thumb_prioritise, NULL);
+}
+
+/* rfm_thumbPool thread: decode, scale and save one thumbnail. The store is not touched here: the saved thumbnail is
+ * picked up by the inotify watch on rfm_thumbDir (see load_thumbnail()).
+ */
+static void mkThumb(RFM_ThumbQueueData *thumbData, gpointer user_data)
+{
+   GdkPixbuf *thumb;
+
+   if (g_atomic_int_get(&rfm_thumbGeneration)==thumbData->generation && !g_atomic_int_get(&thumbData->cancelled)) {
+      if (thumbnailers[thumbData->t_idx].func==NULL)
+         thumb=gdk_pixbuf_new_from_file_at_scale(thumbData->path, RFM_THUMBNAIL_SIZE, RFM_THUMBNAIL_SIZE, TRUE, NULL);
+      else
+         thumb=thumbnailers[thumbData->t_idx].func(thumbData->path, RFM_THUMBNAIL_SIZE);
+      if (thumb!=NULL) {
+         rfm_saveThumbnail(thumb, thumbData);
+         g_object_unref(thumb);
+         thumbData->made=TRUE;
+      }
+   }
+   g_idle_add(thumb_done, thumbData);
+}
+
+/* Find or add the thumbnail job for the item. Jobs are kept in rfm_thumbJobs by path until the directory changes or
+ * Stop is pressed, so items updated by a refresh or inotify don't hash their URI again, and a job already queued or
+ * being made is not queued twice. make is set if the job is new or the file's mtime has changed since it was done.
+ * Returns NULL if the item has no thumbnail.
+ */
+static RFM_ThumbQueueData *get_thumbData(GtkTreeIter *iter, gboolean *make)
+{
+   RFM_ThumbQueueData *thumbData;
+   RFM_FileAttributes *fileAttributes;
+   gint t_idx;
+
+   *make=FALSE;
+   gtk_tree_model_get(GTK_TREE_MODEL(store), iter, COL_ATTR, &fileAttributes, -1);
+
+   if (fileAttributes->is_dir || fileAttributes->is_symlink) return NULL;
+
+   t_idx=find_thumbnailer(fileAttributes->mime_root, fileAttributes->mime_sub_type);
+   if (t_idx==-1) return NULL;  /* Don't show thumbnails for files types with no thumbnailer */
+
+   thumbData=g_hash_table_lookup(rfm_thumbJobs, fileAttributes->path);
+   if (thumbData==NULL) {
+      thumbData=malloc(sizeof(RFM_ThumbQueueData));
+      if (thumbData==NULL) return NULL;
+      thumbData->path=g_strdup(fileAttributes->path);
+      thumbData->mtime_file=fileAttributes->file_mtime;
+      thumbData->uri=g_filename_to_uri(thumbData->path, NULL, NULL);
+      thumbData->md5=g_compute_checksum_for_string(G_CHECKSUM_MD5, thumbData->uri, -1);
+      thumbData->thumb_name=g_strdup_printf("%s.png", thumbData->md5);
+      thumbData->rfm_pid=getpid();  /* pid is used to generate a unique temporary thumbnail name */
+      thumbData->t_idx=t_idx;
+      thumbData->mtime_wanted=thumbData->mtime_file;
+      thumbData->state=RFM_THUMB_DONE;   /* Until queued by do_thumbnails() */
+      thumbData->priority=G_MAXUINT;     /* Until ordered by thumb_prioritise() */
+      thumbData->generation=0;
+      thumbData->cancelled=FALSE;
+      thumbData->made=FALSE;
+      g_hash_table_insert(rfm_thumbJobs, thumbData->path, thumbData);
+      *make=TRUE;
+   }
+   else {
+      if (thumbData->mtime_wanted!=fileAttributes->file_mtime) {
+         thumbData->mtime_wanted=fileAttributes->file_mtime;
+         *make=TRUE;
+      }
+      if (thumbData->state==RFM_THUMB_QUEUED || thumbData->state==RFM_THUMB_DONE) {   /* Else checked by thumb_done() or thumb_loaded_show() */
+         *make|=(thumbData->t_idx!=t_idx);   /* Content type found on reading the file (see resolve_item()) */
+         thumbData->mtime_file=thumbData->mtime_wanted;
+         thumbData->t_idx=t_idx;
+      }
+   }
+   thumbData->record=RFM_STORE_ITER_RECORD(iter);
+
+   /* Map thumb path to the record for inotify: store iters persist, so unlike a GtkTreeRowReference this needn't be updated as rows are added */
+   g_hash_table_insert(thumb_hash, g_strdup(thumbData->thumb_name), GUINT_TO_POINTER(thumbData->record));
+
+   return thumbData;
+}
+
+/* Release the pixbufs: the record itself is freed with its arena */
+static void free_fileAttributes(RFM_FileAttributes *fileAttributes) {
+   if (fileAttributes==NULL) return;   /* Removed from the store */
+   g_clear_object(&(fileAttributes->pixbuf));
+   g_clear_object(&(fileAttributes->thumbnail));
+}
+
+/* All fields NULL / FALSE / 0 */
+static RFM_FileAttributes *malloc_fileAttributes(RFM_Arena *arena)
+{
+   arena->n_records++;
+   return arena_alloc(arena, sizeof(RFM_FileAttributes));
+}
+
+/* Work out the sort key for a file name once, when the item is made, so that sorting is a strcmp() of keys:
+ * comparing names with g_utf8_collate() would convert and case fold both names again on every comparison.
+ */
+static gchar *get_collate_key(RFM_Arena *arena, const gchar *name)
+{
+   gchar *utf8_name, *key, *arena_key;
+
+   if (RFM_SORT_COLLATE==0)
+      return NULL;   /* Byte order of the on-disk names */
+   utf8_name=g_filename_display_name(name);   /* Valid UTF-8 even if the name isn't */
+   if (RFM_SORT_COLLATE==2)
+      key=g_utf8_collate_key_for_filename(utf8_name, -1);  /* Numbers in names compare by value */
+   else
+      key=g_utf8_collate_key(utf8_name, -1);
+   arena_key=arena_strdup(arena, key);
+   g_free(key);
+   g_free(utf8_name);
+   return arena_key;
+}
+
+/* Content type of a non directory: guess from the name, and only read the first RFM_SNIFF_SIZE bytes
+ * if the name is not conclusive (as GIO does for local files). If guessed isn't NULL, a type that can't be
+ * told from the name alone is left as guessed rather than reading the file (unless it was already read by
+ * uring_stat_dirEntries()), and *guessed is set TRUE. Called from the readDir() thread and rfm_sniffPool.
+ */
+static gchar *get_content_type(int dirfd, RFM_DirEntry *entry, gboolean *guessed)
+{
+   gchar *content_type=NULL;
+   gboolean uncertain=FALSE;
+   guchar buffer[RFM_SNIFF_SIZE];
+   guchar *sniff=entry->sniff;
+   ssize_t read_size=entry->sniff_size;
+   int fd;
+
+   if (S_ISCHR(entry->statbuf.st_mode)) return g_strdup("inode/chardevice");
+   if (S_ISBLK(entry->statbuf.st_mode)) return g_strdup("inode/blockdevice");
+   if (S_ISFIFO(entry->statbuf.st_mode)) return g_strdup("inode/fifo");
+   if (S_ISSOCK(entry->statbuf.st_mode)) return g_strdup("inode/socket");
+
+   content_type=g_content_type_guess(entry->name, NULL, 0, &uncertain);
+   if (!uncertain)
+      return content_type;
+   if (entry->statbuf.st_size==0) {
+      g_free(content_type);
+      return g_strdup("application/x-zerosize");
+   }
+
+   if (read_size < 0 && guessed!=NULL) {
+      *guessed=TRUE;
+      return content_type;
+   }
+   if (read_size < 0) { /* Not already read by uring_stat_dirEntries() */
+      fd=openat(dirfd, entry->name, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+      if (fd < 0)
+         return content_type;
+      sniff=buffer;
+      read_size=read(fd, buffer, sizeof(buffer));
+      close(fd);
+   }
+   if (read_size > 0) {
+      g_free(content_type);
+      content_type=g_content_type_guess(entry->name, sniff, read_size, NULL);
+   }
+   return content_type;
+}
+
+/* Synchronous stat of a dir entry, relative to the open directory dirfd. d_type (from readdir()) saves the
+ * extra lstat for symlinks where the file system provides it. Called from the readDir() thread.
+ */
+static void stat_dirEntry(int dirfd, RFM_DirEntry *entry)
+{
+   entry->stat_status=-1;
+   if (entry->type==DT_LNK)
+      entry->is_symlink=TRUE;
+   else {   /* A single lstat is all that's needed for anything other than a symlink */
+      if (fstatat(dirfd, entry->name, &entry->statbuf, AT_SYMLINK_NOFOLLOW)!=0)
+         return;
+      entry->is_symlink=S_ISLNK(entry->statbuf.st_mode);  /* Only for DT_UNKNOWN */
+   }
+   if (entry->is_symlink && fstatat(dirfd, entry->name, &entry->statbuf, 0)!=0) {
+      entry->is_broken=TRUE;   /* Use the link itself for mtime */
+      if (fstatat(dirfd, entry->name, &entry->statbuf, AT_SYMLINK_NOFOLLOW)!=0)
+         return;
+   }
+   entry->stat_status=1;
+}
+
+#ifdef RFM_USE_IO_URING
+static void statx_to_stat(struct statx *stx, struct stat *statbuf)
+{
+   memset(statbuf, 0, sizeof(struct stat));
+   statbuf->st_mode=stx->stx_mode;
+   statbuf->st_ino=stx->stx_ino;
+   statbuf->st_size=stx->stx_size;
+   statbuf->st_mtim.tv_sec=stx->stx_mtime.tv_sec;
+   statbuf->st_mtim.tv_nsec=stx->stx_mtime.tv_nsec;
+}
+
+/* Submit queued requests and wait for all of them; results are indexed by the sqe user data. Buffers and fds given
+ * to the requests must not be released until this returns TRUE. FALSE means the ring failed with requests still in
+ * flight: see uring_stat_dirEntries().
+ */
+static gboolean uring_reap(struct io_uring *ring, guint *in_flight, gint *results)
+{
+   struct io_uring_cqe *cqe;
+   int ret;
+
+   while (*in_flight > 0) {
+      ret=io_uring_submit_and_wait(ring, 1);
+      if (ret < 0 && ret!=-EINTR && ret!=-EAGAIN && ret!=-EBUSY)
+         return FALSE;
+      while (*in_flight > 0 && io_uring_peek_cqe(ring, &cqe)==0) {
+         results[GPOINTER_TO_UINT(io_uring_cqe_get_data(cqe))]=cqe->res;
+         io_uring_cqe_seen(ring, cqe);
+         (*in_flight)--;
+      }
+   }
+   return TRUE;
+}
+
+/* Get an sqe, reaping everything in flight first if the submission queue is full; NULL if the ring failed */
+static struct io_uring_sqe *uring_get_sqe(struct io_uring *ring, guint *in_flight, gint *results)
+{
+   struct io_uring_sqe *sqe=io_uring_get_sqe(ring);
+
+   if (sqe==NULL && uring_reap(ring, in_flight, results))
+      sqe=io_uring_get_sqe(ring);
+   if (sqe!=NULL)
+      (*in_flight)++;
+   return sqe;
+}
+
+/* Stat a chunk of dir entries with batched IORING_OP_STATX requests, then read the first RFM_SNIFF_SIZE bytes of
+ * files that need content sniffing with batched openat / read requests. On high latency file systems (NFS, sshfs)
+ * the requests in a batch are in flight together, so a chunk costs a few round trips rather than one per file.
+ * Every request is reaped before returning, so no result of one chunk can be taken for the next.
+ * Returns RFM_URING_UNSUPPORTED if io_uring can't do the job (e.g. old kernel): entries are then stat'ed
+ * synchronously. RFM_URING_BROKEN means the ring failed with requests in flight: the kernel may still write to the
+ * buffers given to them, so these are leaked (entries get copies of their names) and the ring must not be used again.
+ * sniff is FALSE when most content types are already known (from a snapshot).
+ */
+static gint uring_stat_dirEntries(struct io_uring *ring, int dirfd, RFM_DirEntry *entries, guint n_entries, gboolean sniff)
+{
+   struct statx *stx=g_new(struct statx, 2*n_entries); /* [2i]: lstat; [2i+1]: stat (symlink targets) */
+   gint *results=g_new(gint, 2*n_entries);
+   guint *sniffIdx=g_new(guint, n_entries);
+   gint *fds=g_new(gint, n_entries);
+   gint *read_sizes=g_new(gint, n_entries);
+   guint n_sniff=0;
+   guint in_flight=0;
+   guint i, op;
+   gboolean uncertain;
+   gboolean broken=FALSE;
+   gint status=RFM_URING_OK;
+   struct io_uring_sqe *sqe;
+   gchar *content_type;
+
+   for (op=0; op<2*n_entries; op++)
+      results[op]=-ECANCELED;   /* Not submitted */
+   for (i=0; i<n_entries; i++) {
+      fds[i]=-1;
+      read_sizes[i]=-1;
+   }
+
+   for (op=0; op<2*n_entries && !broken; op++) {
+      i=op/2;
+      if (op%2==1 && entries[i].type!=DT_LNK && entries[i].type!=DT_UNKNOWN)
+         continue;   /* Not a symlink */
+      if ((sqe=uring_get_sqe(ring, &in_flight, results))==NULL)
+         broken=TRUE;
+      else {
+         io_uring_prep_statx(sqe, dirfd, entries[i].name, (op%2==0) ? AT_SYMLINK_NOFOLLOW : 0,
+                             STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME, &stx[op]);
+         io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(op));
+      }
+   }
+   broken=broken || !uring_reap(ring, &in_flight, results);
+
+   for (i=0; i<n_entries && !broken; i++) {
+      if (results[2*i]==-EINVAL || results[2*i]==-EOPNOTSUPP) {
+         status=RFM_URING_UNSUPPORTED;   /* IORING_OP_STATX not supported */
+         break;
+      }
+      entries[i].stat_status=-1;
+      if (results[2*i] < 0)
+         continue;
+      entries[i].is_symlink=S_ISLNK(stx[2*i].stx_mode);
+      if (entries[i].is_symlink && results[2*i+1]==0)
+         statx_to_stat(&stx[2*i+1], &entries[i].statbuf);
+      else {
+         entries[i].is_broken=entries[i].is_symlink;
+         statx_to_stat(&stx[2*i], &entries[i].statbuf);
+      }
+      entries[i].stat_status=1;
+
+      if (sniff && !entries[i].is_broken && S_ISREG(entries[i].statbuf.st_mode) && entries[i].statbuf.st_size > 0) {
+         content_type=g_content_type_guess(entries[i].name, NULL, 0, &uncertain);
+         g_free(content_type);
+         if (uncertain)
+            sniffIdx[n_sniff++]=i;
+      }
+   }
+   if (broken || status!=RFM_URING_OK)
+      n_sniff=0;
+
+   /* Content sniffing: open all, then read all */
+   for (op=0; op<n_sniff && !broken; op++) {
+      if ((sqe=uring_get_sqe(ring, &in_flight, fds))==NULL)
+         broken=TRUE;
+      else {
+         io_uring_prep_openat(sqe, dirfd, entries[sniffIdx[op]].name, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK, 0);
+         io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(op));
+      }
+   }
+   broken=broken || !uring_reap(ring, &in_flight, fds);
+   for (op=0; op<n_sniff && !broken; op++) {
+      if (fds[op] < 0)
+         continue;
+      entries[sniffIdx[op]].sniff=g_malloc(RFM_SNIFF_SIZE);
+      if ((sqe=uring_get_sqe(ring, &in_flight, read_sizes))==NULL)
+         broken=TRUE;
+      else {
+         io_uring_prep_read(sqe, fds[op], entries[sniffIdx[op]].sniff, RFM_SNIFF_SIZE, 0);
+         io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(op));
+      }
+   }
+   broken=broken || !uring_reap(ring, &in_flight, read_sizes);
+
+   if (broken) {   /* Requests may still be in flight: leak everything they were given and start again synchronously */
+      for (i=0; i<n_entries; i++) {
+         entries[i].name=g_strdup(entries[i].name);
+         entries[i].sniff=NULL;
+         entries[i].sniff_size=-1;
+      }
+      g_warning("uring_stat_dirEntries: io_uring failed: reading synchronously");
+      status=RFM_URING_BROKEN;
+   }
+   else {
+      for (op=0; op<n_sniff; op++) {
+         if (read_sizes[op] >= 0)
+            entries[sniffIdx[op]].sniff_size=read_sizes[op];
+         if (fds[op] >= 0)
+            close(fds[op]);
+      }
+      g_free(stx);
+      g_free(results);
+      g_free(fds);
+      g_free(read_sizes);
+   }
+   /* Anything not read here (sniff_size still -1) is read again by get_content_type() */
+   if (status!=RFM_URING_OK) {
+      for (i=0; i<n_entries; i++) {
+         entries[i].stat_status=0;
+         entries[i].is_symlink=entries[i].is_broken=FALSE;
+      }
+   }
+   g_free(sniffIdx);
+   return status;
+}
+#endif
+
+/* Common part of get_file_info() and snapshot_fileAttributes(): called from the readDir() thread */
+static RFM_FileAttributes *new_fileAttributes(RFM_Arena *arena, const gchar *dir_path, const gchar *name, gboolean is_symlink, guint64 mtime, guint64 size, guint64 mtimeThreshold)
+{
+   gchar *utf8_display_name=NULL;
+   gchar *tmp;
+   RFM_FileAttributes *fileAttributes=malloc_fileAttributes(arena);
+
+   fileAttributes->is_symlink=is_symlink;
+   tmp=g_build_filename(dir_path, name, NULL);
+   fileAttributes->path=arena_strdup(arena, tmp);
+   g_free(tmp);
+   fileAttributes->file_mtime=mtime;
+   fileAttributes->file_size=size;
+   fileAttributes->file_name=arena_strdup(arena, name);
+   fileAttributes->extension=strrchr(fileAttributes->file_name, '.');
+   fileAttributes->collate_key=get_collate_key(arena, name);
+   utf8_display_name=g_filename_to_utf8(name, -1, NULL, NULL, NULL);
+   if (fileAttributes->file_mtime > mtimeThreshold)
+      tmp=g_markup_printf_escaped("<b>%s</b>", utf8_display_name);
+   else
+      tmp=g_markup_printf_escaped("%s", utf8_display_name);
+   fileAttributes->display_name=arena_strdup(arena, tmp);
+   g_free(tmp);
+   g_free(utf8_display_name);
+   return fileAttributes;
+}
+
+/* Copy an item into another arena: the copy takes the pixbufs */
+static RFM_FileAttributes *copy_fileAttributes(RFM_Arena *arena, RFM_FileAttributes *fileAttributes)
+{
+   RFM_FileAttributes *copy=malloc_fileAttributes(arena);
+
+   *copy=*fileAttributes;
+   copy->path=arena_strdup(arena, fileAttributes->path);
+   copy->file_name=arena_strdup(arena, fileAttributes->file_name);
+   copy->extension=strrchr(copy->file_name, '.');
+   copy->display_name=arena_strdup(arena, fileAttributes->display_name);
+   if (fileAttributes->collate_key!=NULL)
+      copy->collate_key=arena_strdup(arena, fileAttributes->collate_key);
+   fileAttributes->pixbuf=NULL;
+   fileAttributes->thumbnail=NULL;
+   return copy;
+}
+
+/* Set the content type and icon name from mime_type, which is left as it was */
+static void set_mime_type(RFM_Arena *arena, RFM_FileAttributes *fileAttributes, gchar *mime_type)
+{
+   gint i;
+
+   for (i=0; i<strlen(mime_type); i++) {
+      if (mime_type[i]=='/') {
+         mime_type[i]='\0';
+         fileAttributes->mime_root=arena_intern(arena, mime_type);
+         fileAttributes->mime_sub_type=arena_intern(arena, mime_type+i+1);
+         mime_type[i]='-';
+         fileAttributes->icon_name=arena_intern(arena, mime_type);
+         mime_type[i]='/';
+         break;
+      }
+   }
+}
+
+/* Set mime type and default pixbuf: mime_type is the content type of anything other than a directory or
+ * broken link; this takes ownership of it. Called from the readDir() thread.
+ */
+static void set_file_type(RFM_Arena *arena, RFM_FileAttributes *fileAttributes, gboolean is_dir, gboolean is_broken, gchar *mime_type, GHashTable *mount_hash, RFM_defaultPixbufs *defaultPixbufs)
+{
+   gchar *is_mounted=NULL;
+
+   if (is_broken) {
+      fileAttributes->mime_root=arena_intern(arena, "application");
+      fileAttributes->mime_sub_type=arena_intern(arena, "octet-stream");
+      fileAttributes->pixbuf=g_object_ref(defaultPixbufs->broken);
+   }
+   else if (is_dir) {
+      fileAttributes->is_dir=TRUE;
+      fileAttributes->mime_root=arena_intern(arena, "inode");
+      if (fileAttributes->is_symlink) {
+         fileAttributes->mime_sub_type=arena_intern(arena, "symlink");
+         fileAttributes->pixbuf=g_object_ref(defaultPixbufs->symlinkDir);
+      }
+      else if (g_hash_table_lookup_extended(mount_hash, fileAttributes->path, NULL, (gpointer)&is_mounted)) {
+         fileAttributes->mime_sub_type=arena_intern(arena, "mount-point");
+         fileAttributes->is_mountPoint=TRUE;
+         if (is_mounted[0]=='0')
+            fileAttributes->pixbuf=g_object_ref(defaultPixbufs->unmounted);
+         else
+            fileAttributes->pixbuf=g_object_ref(defaultPixbufs->mounted);
+      }
+      else {
+         fileAttributes->mime_sub_type=arena_intern(arena, "directory");
+         fileAttributes->pixbuf=g_object_ref(defaultPixbufs->dir);
+      }
+   }
+   else {   /* Regular file, socket, fifo, block device, or character device */
+      set_mime_type(arena, fileAttributes, mime_type);
+      g_free(mime_type);
+      if (fileAttributes->is_symlink)
+         fileAttributes->pixbuf=g_object_ref(defaultPixbufs->symlinkFile);
+      else
+         fileAttributes->pixbuf=g_object_ref(defaultPixbufs->file);
+   }
+}
+
+/* Called from the readDir() thread (and inotify_flush() for single items): must not use rfm globals or gtk.
+ * If sniff is FALSE, content types that can't be told from the name are only guessed: see resolve_item().
+ */
+static RFM_FileAttributes *get_file_info(RFM_Arena *arena, int dirfd, const gchar *dir_path, RFM_DirEntry *entry, guint64 mtimeThreshold, GHashTable *mount_hash, RFM_defaultPixbufs *defaultPixbufs, gboolean sniff)
+{
+   gboolean is_dir;
+   gboolean guessed=FALSE;
+   RFM_FileAttributes *fileAttributes;
+
+   if (entry->stat_status==0)
+      stat_dirEntry(dirfd, entry);
+   if (entry->stat_status!=1)
+      return NULL;   /* Vanished */
+
+   fileAttributes=new_fileAttributes(arena, dir_path, entry->name, entry->is_symlink, (guint64)entry->statbuf.st_mtime, (guint64)entry->statbuf.st_size, mtimeThreshold);
+   is_dir=S_ISDIR(entry->statbuf.st_mode);
+   set_file_type(arena, fileAttributes, is_dir, entry->is_broken,
+                 (is_dir || entry->is_broken) ? NULL : get_content_type(dirfd, entry, sniff ? NULL : &guessed), mount_hash, defaultPixbufs);
+   fileAttributes->file_ino=(guint64)entry->statbuf.st_ino;
+   fileAttributes->mime_guessed=guessed;
+   return fileAttributes;
+}
+
+/* Load or queue thumbnails for rows just added to the store; iters remain valid as RFM_Store iters persist */
+static void do_thumbnails(GList *iterList)
+{
+   GList *listElement;
+   GList *newQueue=NULL;
+   RFM_ThumbQueueData *thumbData=NULL;
+   gboolean make;
+
+   for (listElement=iterList; listElement!=NULL; listElement=g_list_next(listElement)) {
+      thumbData=get_thumbData(listElement->data, &make); /* Returns NULL if thumbnail not handled */
+      if (thumbData==NULL || thumbData->state!=RFM_THUMB_DONE)
+         continue;   /* Already loading, queued or being made: the thumbnail is loaded when saved */
+      if (!make && thumb_item(thumbData)->thumbnail!=NULL)
+         continue;   /* Kept by keep_fileAttributes() */
+      if (rfm_thumbIndexReady && !g_hash_table_contains(rfm_thumbIndex, thumbData->thumb_name)) {
+         if (make) {   /* Not in the cache: no need to look */
+            thumbData->state=RFM_THUMB_QUEUED;
+            newQueue=g_list_prepend(newQueue, thumbData);
+         }
+         continue;
+      }
+      /* Try to load any existing thumbnail: queued to be made by thumb_loaded_show() if it isn't valid and make is set */
+      thumbData->state=RFM_THUMB_LOADING;
+      thumb_load_request(thumbData->record, thumbData->thumb_name, thumbData->path, thumbData->uri, thumbData->mtime_file, TRUE, make);
+   }
+   if (newQueue!=NULL) {
+      rfm_thumbQueue=g_list_concat(rfm_thumbQueue, g_list_reverse(newQueue));
+      schedule_thumbs();   /* Ordered by the view before any are made */
+   }
+}
+
+/* Select the directory we came up from (see up_clicked()) once its row is added */
+static void select_prePath(RFM_FileAttributes *fileAttributes, GtkTreeIter *iter)
+{
+   GtkTreePath *treePath;
+
+   if (rfm_prePath!=NULL && g_strcmp0(rfm_prePath, fileAttributes->path)==0) {
+      treePath=gtk_tree_model_get_path(GTK_TREE_MODEL(store), iter);
+      gtk_icon_view_select_path(GTK_ICON_VIEW(icon_view), treePath);
+      gtk_icon_view_scroll_to_path(GTK_ICON_VIEW(icon_view), treePath, TRUE, 1.0, 1.0);
+      gtk_tree_path_free(treePath);
+      g_free(rfm_prePath);
+      rfm_prePath=NULL; /* No need to check any more paths once found */
+   }
+}
+
+/* Replace the default pixbuf with the theme icon for the mime type: the theme is only asked once per icon name
+ * (see icon_cache_lookup()), and all symlinks to files of a type share one composited pixbuf.
+ */
+static void load_theme_icon(RFM_FileAttributes *fileAttributes, RFM_defaultPixbufs *defaultPixbufs)
+{
+   GdkPixbuf *pixbuf=NULL;
+   GdkPixbuf *base;
+   gchar *generic;
+   guint emblem=fileAttributes->is_symlink ? RFM_EMBLEM_SYMLINK : 0;
+
+   if (fileAttributes->icon_name==NULL)
+      return;
+
+   if (!icon_cache_lookup(fileAttributes->icon_name, RFM_ICON_SIZE, 0, &base)) {
+      /* Fall back to generic icon if possible: GTK_ICON_LOOKUP_GENERIC_FALLBACK doesn't always work, e.g. flac files */
+      if (!gtk_icon_theme_has_icon(icon_theme, fileAttributes->icon_name)) {
+         generic=g_strjoin("-", fileAttributes->mime_root, "x-generic", NULL);
+         base=gtk_icon_theme_load_icon(icon_theme, generic, RFM_ICON_SIZE, GTK_ICON_LOOKUP_GENERIC_FALLBACK, NULL);
+         g_free(generic);
+      }
+      else
+         base=gtk_icon_theme_load_icon(icon_theme, fileAttributes->icon_name, RFM_ICON_SIZE, GTK_ICON_LOOKUP_GENERIC_FALLBACK, NULL);
+      icon_cache_insert(fileAttributes->icon_name, RFM_ICON_SIZE, 0, base);
+   }
+
+   pixbuf=base;
+   if (emblem!=0 && !icon_cache_lookup(fileAttributes->icon_name, RFM_ICON_SIZE, emblem, &pixbuf)) {
+      pixbuf=(base!=NULL) ? composite_emblem(base, defaultPixbufs->symlink, 0, 200) : NULL;
+      icon_cache_insert(fileAttributes->icon_name, RFM_ICON_SIZE, emblem, pixbuf);
+   }
+
+   if (pixbuf!=NULL) {
+      g_object_unref(fileAttributes->pixbuf);
+      fileAttributes->pixbuf=g_object_ref(pixbuf);
+   }
+}
+
+/* Content type of a file read from its start: see resolve_item() */
+static gchar *sniff_content_type(const gchar *path, guint64 file_size)
+{
+   RFM_DirEntry entry;
+
+   memset(&entry, 0, sizeof(entry));
+   entry.name=(gchar*)path;   /* Absolute, so opened relative to AT_FDCWD */
+   entry.statbuf.st_mode=S_IFREG;
+   entry.statbuf.st_size=file_size;
+   entry.sniff_size=-1;
+   return get_content_type(AT_FDCWD, &entry, NULL);
+}
+
+/* Load the theme icon for the record's content type, setting it first from mime_type if that isn't NULL */
+static void resolve_apply(guint record, gchar *mime_type)
+{
+   RFM_defaultPixbufs *defaultPixbufs=g_object_get_data(G_OBJECT(window),"rfm_default_pixbufs");
+   RFM_FileAttributes *fileAttributes=RFM_STORE_RECORD(store, record);
+   const gchar *mime_root=fileAttributes->mime_root;
+   const gchar *mime_sub_type=fileAttributes->mime_sub_type;
+   GdkPixbuf *pixbuf=fileAttributes->pixbuf;
+   GtkTreeIter iter;
+   GList *iterList;
+
+   if (mime_type!=NULL) {
+      set_mime_type(rfm_store_arena(store), fileAttributes, mime_type);
+      fileAttributes->mime_guessed=FALSE;
+   }
+   load_theme_icon(fileAttributes, defaultPixbufs);
+
+   rfm_store_set_iter(store, &iter, record);
+   if (fileAttributes->mime_root==mime_root && fileAttributes->mime_sub_type==mime_sub_type) {
+      if (fileAttributes->pixbuf!=pixbuf)
+         rfm_store_row_changed(store, &iter);
+      return;
+   }
+   rfm_store_changed(store, &iter);
+   schedule_resolve();   /* The row may have moved, and others into view in its place */
+   schedule_thumbs();
+   if (rfm_do_thumbs==1 && g_file_test(rfm_thumbDir, G_FILE_TEST_IS_DIR)) {
+      iterList=g_list_prepend(NULL, &iter);
+      do_thumbnails(iterList);
+      g_list_free(iterList);
+   }
+}
+
+/* The record may have been replaced, removed or renumbered since the job was queued */
+static gboolean resolve_sniffed(gpointer user_data)
+{
+   RFM_SniffJob *job=(RFM_SniffJob*)user_data;
+   RFM_FileAttributes *fileAttributes;
+
+   rfm_sniffsPending--;
+   if (job->stamp==store->stamp && job->record < store->records->len) {
+      fileAttributes=RFM_STORE_RECORD(store, job->record);
+      if (fileAttributes!=NULL && fileAttributes==job->fileAttributes && fileAttributes->mime_guessed)
+         resolve_apply(job->record, job->mime_type);
+   }
+   g_free(job->path);
+   g_free(job->mime_type);
+   g_free(job);
+   if (rfm_sniffsPending==0)
+      compact_store();
+   return FALSE;
+}
+
+/* rfm_sniffPool thread: read the start of the file for resolve_sniffed() */
+static void sniff_thread(RFM_SniffJob *job, gpointer user_data)
+{
+   job->mime_type=sniff_content_type(job->path, job->file_size);
+   g_idle_add(resolve_sniffed, job);
+}
+
+/* Finish an item added with the default icon and perhaps a content type guessed from its name: the theme icon is
+ * loaded, and if the name wasn't enough the start of the file is read in rfm_sniffPool. The type is read here
+ * instead if it is needed now. Thumbnails are tried again if the type changes; the row may move if the view is
+ * sorted by type.
+ */
+static void resolve_item(guint record, gboolean now)
+{
+   RFM_FileAttributes *fileAttributes=RFM_STORE_RECORD(store, record);
+   RFM_SniffJob *job;
+   gchar *mime_type;
+
+   if (fileAttributes==NULL || (fileAttributes->resolved && !(now && fileAttributes->mime_guessed)))
+      return;   /* Done, or being read by rfm_sniffPool and not needed yet */
+   fileAttributes->resolved=TRUE;
+
+   if (fileAttributes->mime_guessed && now) {   /* Any result from rfm_sniffPool is then ignored */
+      mime_type=sniff_content_type(fileAttributes->path, fileAttributes->file_size);
+      resolve_apply(record, mime_type);
+      g_free(mime_type);
+      return;
+   }
+   resolve_apply(record, NULL);   /* For the type from the name until the file is read */
+   if (fileAttributes->mime_guessed) {
+      job=g_new0(RFM_SniffJob, 1);
+      job->record=record;
+      job->fileAttributes=fileAttributes;
+      job->stamp=store->stamp;
+      job->path=g_strdup(fileAttributes->path);
+      job->file_size=fileAttributes->file_size;
+      rfm_sniffsPending++;
+      g_thread_pool_push(rfm_sniffPool, job, NULL);
+   }
+}
+
+/* Items are added with cheap placeholder data (see get_file_info()); only those in view, and RFM_VIEW_MARGIN rows
+ * either side, are finished by resolve_item(). Runs at idle priority after the view is drawn, scheduled by
+ * schedule_resolve() whenever items are added or the view scrolls or changes size.
+ */
+static gboolean resolve_visible(gpointer user_data)
+{
+   GtkTreePath *startPath=NULL, *endPath=NULL;
+   GArray *records;
+   gint start=0, end=RFM_VIEW_MARGIN, row;
+   guint record;
+   guint i;
+
+   rfm_resolveScheduler=0;
+   if (gtk_icon_view_get_visible_range(GTK_ICON_VIEW(icon_view), &startPath, &endPath)) {
+      start=gtk_tree_path_get_indices(startPath)[0]-RFM_VIEW_MARGIN;
+      end=gtk_tree_path_get_indices(endPath)[0]+RFM_VIEW_MARGIN;
+      gtk_tree_path_free(startPath);
+      gtk_tree_path_free(endPath);
+   }
+   start=MAX(start, 0);
+   end=MIN(end, (gint)store->order->len-1);
+
+   records=g_array_new(FALSE, FALSE, sizeof(guint));
+   for (row=start; row<=end; row++) {
+      record=RFM_STORE_ORDER(store, row);
+      if (!RFM_STORE_RECORD(store, record)->resolved)
+         g_array_append_val(records, record);
+   }
+   for (i=0; i<records->len; i++)
+      resolve_item(g_array_index(records, guint, i), FALSE);   /* By record: rows may move */
+   g_array_free(records, TRUE);
+   return FALSE;
+}
+
+static void schedule_resolve(void)
+{
+   if (rfm_resolveScheduler==0)
+      rfm_resolveScheduler=g_idle_add(resolve_visible, NULL);
+}
+
+static void view_scrolled(GtkAdjustment *adjustment, gpointer user_data)
+{
+   schedule_resolve();
+   schedule_thumbs();
+}
+
+/* The content types of the selected items are needed now, even for those not in view */
+static void resolve_selection(void)
+{
+   GList *selectionList=gtk_icon_view_get_selected_items(GTK_ICON_VIEW(icon_view));
+   GList *listElement;
+   GArray *records=g_array_new(FALSE, FALSE, sizeof(guint));
+   GtkTreeIter iter;
+   guint record;
+   guint i;
+
+   for (listElement=selectionList; listElement!=NULL; listElement=g_list_next(listElement)) {
+      gtk_tree_model_get_iter(GTK_TREE_MODEL(store), &iter, listElement->data);
+      record=RFM_STORE_ITER_RECORD(&iter);
+      g_array_append_val(records, record);
+   }
+   g_list_free_full(selectionList, (GDestroyNotify)gtk_tree_path_free);
+   for (i=0; i<records->len; i++)
+      resolve_item(g_array_index(records, guint, i), TRUE);
+   g_array_free(records, TRUE);
+}
+
+/* Point an item showing one of the old default icons at the new one */
+static void swap_default_pixbuf(RFM_FileAttributes *fileAttributes, RFM_defaultPixbufs *oldPixbufs, RFM_defaultPixbufs *newPixbufs)
+{
+   static const gsize offsets[]={ G_STRUCT_OFFSET(RFM_defaultPixbufs, file), G_STRUCT_OFFSET(RFM_defaultPixbufs, dir),
+                                  G_STRUCT_OFFSET(RFM_defaultPixbufs, symlinkDir), G_STRUCT_OFFSET(RFM_defaultPixbufs, symlinkFile),
+                                  G_STRUCT_OFFSET(RFM_defaultPixbufs, unmounted), G_STRUCT_OFFSET(RFM_defaultPixbufs, mounted),
+                                  G_STRUCT_OFFSET(RFM_defaultPixbufs, broken) };
+   guint i;
+
+   for (i=0; i<G_N_ELEMENTS(offsets); i++) {
+      if (fileAttributes->pixbuf==G_STRUCT_MEMBER(GdkPixbuf*, oldPixbufs, offsets[i])) {
+         g_object_unref(fileAttributes->pixbuf);
+         fileAttributes->pixbuf=g_object_ref(G_STRUCT_MEMBER(GdkPixbuf*, newPixbufs, offsets[i]));
+         return;
+      }
+   }
+}
+
+/* Icons already loaded keep the old theme's pixbufs: the default icons are loaded again and swapped in, and theme
+ * icons are loaded again as items are shown. readDir() threads keep their reference to the old defaults until they
+ * finish. The toolbar keeps its icons.
+ */
+static void icon_theme_changed(GtkIconTheme *theme, gpointer user_data)
+{
+   RFM_defaultPixbufs *oldPixbufs=default_pixbufs_ref(g_object_get_data(G_OBJECT(window), "rfm_default_pixbufs"));
+   RFM_defaultPixbufs *defaultPixbufs;
+   RFM_FileAttributes *fileAttributes;
+   guint i;
+
+   g_hash_table_remove_all(rfm_iconCache);
+   defaultPixbufs=load_default_pixbufs();
+   if (defaultPixbufs!=NULL)   /* Drops the window's reference to the old defaults */
+      g_object_set_data_full(G_OBJECT(window), "rfm_default_pixbufs", defaultPixbufs, (GDestroyNotify)default_pixbufs_unref);
+   dirCache_clear();   /* Cached listings hold the old icons */
+   for (i=0; i<store->records->len; i++) {
+      fileAttributes=RFM_STORE_RECORD(store, i);
+      if (fileAttributes==NULL)
+         continue;
+      fileAttributes->resolved=FALSE;
+      if (defaultPixbufs!=NULL)
+         swap_default_pixbuf(fileAttributes, oldPixbufs, defaultPixbufs);
+   }
+   default_pixbufs_unref(oldPixbufs);
+   gtk_widget_queue_draw(icon_view);
+   schedule_resolve();
+}
+
+/* Unset the model from icon_view while many rows change: GtkIconView handles each row signal in O(n) */
+static void iconView_detach(void)
+{
+   gtk_icon_view_set_model(GTK_ICON_VIEW(icon_view), NULL);
+   store->silent=TRUE;
+}
+
+/* Set the model again: the view builds all its items in one pass */
+static void iconView_attach(void)
+{
+   if (store->unsorted) {
+      rfm_store_sort(store);
+      store->unsorted=FALSE;
+   }
+   store->silent=FALSE;
+   gtk_icon_view_set_model(GTK_ICON_VIEW(icon_view), GTK_TREE_MODEL(store));
+}
+
+/* The selection and the first visible item, kept as record indices (store iters persist) while the view is detached */
+static void iconView_save(RFM_ViewState *state)
+{
+   GList *listElement;
+   GtkTreePath *treePath=NULL;
+   GtkTreeIter iter;
+
+   state->selected=gtk_icon_view_get_selected_items(GTK_ICON_VIEW(icon_view));
+   for (listElement=state->selected; listElement!=NULL; listElement=g_list_next(listElement)) {
+      gtk_tree_model_get_iter(GTK_TREE_MODEL(store), &iter, listElement->data);
+      gtk_tree_path_free(listElement->data);
+      listElement->data=GUINT_TO_POINTER(RFM_STORE_ITER_RECORD(&iter));
+   }
+   state->scroll=FALSE;
+   if (gtk_icon_view_get_visible_range(GTK_ICON_VIEW(icon_view), &treePath, NULL)) {
+      gtk_tree_model_get_iter(GTK_TREE_MODEL(store), &iter, treePath);
+      state->topRecord=RFM_STORE_ITER_RECORD(&iter);
+      state->scroll=TRUE;
+      gtk_tree_path_free(treePath);
+   }
+}
+
+/* Select and scroll to the saved records again, once the view is attached; records removed meanwhile are skipped */
+static void iconView_restore(RFM_ViewState *state)
+{
+   GList *listElement;
+   GtkTreePath *treePath;
+   GtkTreeIter iter;
+   guint record;
+
+   for (listElement=state->selected; listElement!=NULL; listElement=g_list_next(listElement)) {
+      record=GPOINTER_TO_UINT(listElement->data);
+      if (RFM_STORE_RECORD(store, record)==NULL)
+         continue;
+      rfm_store_set_iter(store, &iter, record);
+      treePath=gtk_tree_model_get_path(GTK_TREE_MODEL(store), &iter);
+      gtk_icon_view_select_path(GTK_ICON_VIEW(icon_view), treePath);
+      gtk_tree_path_free(treePath);
+   }
+   g_list_free(state->selected);
+   state->selected=NULL;
+   if (state->scroll && RFM_STORE_RECORD(store, state->topRecord)!=NULL) {
+      rfm_store_set_iter(store, &iter, state->topRecord);
+      treePath=gtk_tree_model_get_path(GTK_TREE_MODEL(store), &iter);
+      gtk_icon_view_scroll_to_path(GTK_ICON_VIEW(icon_view), treePath, TRUE, 0.0, 0.0);
+      gtk_tree_path_free(treePath);
+   }
+}
+
+/* Add items to the store; returns the first new record. Large batches, and the first items of a listing, are added
+ * with the model unset from icon_view: GtkIconView walks its item list for each row-inserted signal, so adding n
+ * rows to a live view is O(n^2), whereas setting the model again builds all items in one pass. The selection and
+ * the first visible item are kept as record indices (store iters persist).
+ */
+static guint iconView_append(GPtrArray *items)
+{
+   RFM_ViewState state={ NULL, FALSE, 0 };
+   guint first;
+
+   if (store->records->len > 0 && items->len < RFM_BULK_MIN)
+      return rfm_store_append(store, items);
+
+   if (store->records->len > 0)
+      iconView_save(&state);
+   iconView_detach();
+   first=rfm_store_append(store, items);
+   iconView_attach();
+   iconView_restore(&state);
+   return first;
+}
+
+/* Thumbnails and the selection for the records added from first on */
+static void iconView_added(guint first)
+{
+   GList *iterList=NULL;
+   GtkTreeIter iter;
+   GtkTreeIter *thumbIter;
+   gboolean thumbs=(rfm_do_thumbs==1 && g_file_test(rfm_thumbDir, G_FILE_TEST_IS_DIR));
+   guint record;
+
+   for (record=first; record<store->records->len; record++) {
+      rfm_store_set_iter(store, &iter, record);
+      if (thumbs) {
+         thumbIter=g_new(GtkTreeIter, 1);
+         *thumbIter=iter;
+         iterList=g_list_prepend(iterList, thumbIter);
+      }
+      select_prePath(RFM_STORE_RECORD(store, record), &iter);
+   }
+   schedule_resolve();   /* Rows shown may have moved */
+   schedule_thumbs();
+
+   if (iterList!=NULL) {
+      do_thumbnails(g_list_reverse(iterList));
+      g_list_free_full(iterList, (GDestroyNotify)g_free);
+   }
+}
+
+/* Add newly read items to the store: called for each batch while the directory is still being read. The store takes the items. */
+static void updateIconView(GPtrArray *newItems)
+{
+   iconView_added(iconView_append(newItems));
+}
+
+/* Keep what was found for an item replaced while its file's contents are unchanged, e.g. when only the bold marker
+ * for recently modified items has expired: its thumbnail, and its content type and theme icon once resolved.
+ */
+static void keep_fileAttributes(RFM_FileAttributes *oldAttributes, RFM_FileAttributes *newAttributes)
+{
+   if (oldAttributes->file_mtime!=newAttributes->file_mtime || oldAttributes->file_size!=newAttributes->file_size
+         || oldAttributes->is_dir!=newAttributes->is_dir || oldAttributes->is_symlink!=newAttributes->is_symlink
+         || oldAttributes->is_mountPoint!=newAttributes->is_mountPoint)
+      return;
+   if (oldAttributes->file_ino!=0 && newAttributes->file_ino!=0 && oldAttributes->file_ino!=newAttributes->file_ino)
+      return;
+   if (newAttributes->thumbnail==NULL && oldAttributes->thumbnail!=NULL)
+      newAttributes->thumbnail=g_object_ref(oldAttributes->thumbnail);
+   if (!oldAttributes->resolved || oldAttributes->mime_guessed || newAttributes->icon_name==NULL
+         || (!newAttributes->mime_guessed && (oldAttributes->mime_root!=newAttributes->mime_root
+                                              || oldAttributes->mime_sub_type!=newAttributes->mime_sub_type)))
+      return;   /* Not looked up yet, a mount point's icon, or the type was read again and differs */
+   newAttributes->mime_root=oldAttributes->mime_root;   /* Interned strings */
+   newAttributes->mime_sub_type=oldAttributes->mime_sub_type;
+   newAttributes->icon_name=oldAttributes->icon_name;
+   newAttributes->mime_guessed=FALSE;
+   newAttributes->resolved=TRUE;
+   g_clear_object(&(newAttributes->pixbuf));
+   if (oldAttributes->pixbuf!=NULL)
+      newAttributes->pixbuf=g_object_ref(oldAttributes->pixbuf);
+}
+
+/* Replace items already in the store with up to date items of the same name, e.g. those found by the readDir()
+ * thread's scan for items shown from a snapshot. Items not in the store are added. The store takes the items.
+ * At least RFM_BULK_MIN updates (e.g. after touch *) are applied with the view detached and the rows sorted once,
+ * instead of a move and a signal per row.
+ */
+static void replace_items(GPtrArray *updates)
+{
+   GPtrArray *unmatched=g_ptr_array_new();
+   GList *iterList=NULL;
+   GtkTreeIter iter;
+   GtkTreeIter *thumbIter;
+   RFM_FileAttributes *newAttributes;
+   RFM_ViewState state;
+   gboolean thumbs=(rfm_do_thumbs==1 && g_file_test(rfm_thumbDir, G_FILE_TEST_IS_DIR));
+   gboolean bulk=(updates->len >= RFM_BULK_MIN);
+   guint first=store->records->len;
+   guint i;
+
+   if (bulk) {
+      iconView_save(&state);
+      iconView_detach();
+   }
+   for (i=0; i<updates->len; i++) {
+      newAttributes=g_ptr_array_index(updates, i);
+      if (!rfm_store_lookup(store, newAttributes->file_name, &iter)) {
+         g_ptr_array_add(unmatched, newAttributes);
+         continue;
+      }
+      keep_fileAttributes(RFM_STORE_RECORD(store, RFM_STORE_ITER_RECORD(&iter)), newAttributes);
+      rfm_store_replace(store, &iter, newAttributes);   /* iter stays valid if the row moves */
+      if (thumbs) {
+         thumbIter=g_new(GtkTreeIter, 1);
+         *thumbIter=iter;
+         iterList=g_list_prepend(iterList, thumbIter);
+      }
+   }
+   g_ptr_array_set_size(updates, 0);
+   schedule_resolve();   /* Rows shown may have moved */
+   schedule_thumbs();
+
+   if (bulk) {
+      first=rfm_store_append(store, unmatched);
+      iconView_attach();
+      iconView_restore(&state);
+      if (store->records->len > first)
+         iconView_added(first);
+   }
+   else if (unmatched->len > 0)
+      updateIconView(unmatched);
+   g_ptr_array_free(unmatched, TRUE);
+
+   if (iterList!=NULL) {
+      do_thumbnails(g_list_reverse(iterList));
+      g_list_free_full(iterList, (GDestroyNotify)g_free);
+   }
+}
+
+/* TRUE if newAttributes, just read, would show the same as the item in the store. Inodes are only compared if
+ * both are known. Mount point icons have no theme icon, so a mount or unmount shows as a change of pixbuf.
+ */
+static gboolean same_fileAttributes(RFM_FileAttributes *oldAttributes, RFM_FileAttributes *newAttributes)
+{
+   if (oldAttributes->file_mtime!=newAttributes->file_mtime || oldAttributes->file_size!=newAttributes->file_size)
+      return FALSE;
+   if (oldAttributes->file_ino!=0 && newAttributes->file_ino!=0 && oldAttributes->file_ino!=newAttributes->file_ino)
+      return FALSE;
+   if (oldAttributes->is_dir!=newAttributes->is_dir || oldAttributes->is_symlink!=newAttributes->is_symlink
+         || oldAttributes->is_mountPoint!=newAttributes->is_mountPoint)
+      return FALSE;
+   if ((!newAttributes->mime_guessed || oldAttributes->mime_guessed)
+         && (oldAttributes->mime_root!=newAttributes->mime_root || oldAttributes->mime_sub_type!=newAttributes->mime_sub_type))
+      return FALSE;   /* Interned strings; a guess is no news if the old item's file was read, as its contents haven't changed */
+   if (oldAttributes->icon_name==NULL && oldAttributes->pixbuf!=newAttributes->pixbuf)
+      return FALSE;
+   return strcmp(oldAttributes->display_name, newAttributes->display_name)==0;  /* Recently modified items are shown in bold */
+}
+
+/* A batch read by refresh_store(): items unchanged from those in the store are dropped, so their rows, thumbnails and
+ * selection stay as they are. Changed and new items are copied to the store's arena and replace or add rows: the
+ * batch arena isn't kept, as it holds a copy of every item. Records found are marked in rfm_reconcileSeen.
+ */
+static void reconcile_items(GPtrArray *items)
+{
+   GPtrArray *updates=g_ptr_array_new();
+   RFM_Arena *arena=rfm_store_arena(store);
+   RFM_FileAttributes *fileAttributes;
+   GtkTreeIter iter;
+   guint record;
+   guint i;
+
+   for (i=0; i<items->len; i++) {
+      fileAttributes=g_ptr_array_index(items, i);
+      if (rfm_store_lookup(store, fileAttributes->file_name, &iter)) {
+         record=RFM_STORE_ITER_RECORD(&iter);
+         if (record < rfm_reconcileSeen->len)
+            rfm_reconcileSeen->data[record]=1;
+         if (same_fileAttributes(RFM_STORE_RECORD(store, record), fileAttributes)) {
+            free_fileAttributes(fileAttributes);
+            continue;
+         }
+      }
+      g_ptr_array_add(updates, copy_fileAttributes(arena, fileAttributes));
+      free_fileAttributes(fileAttributes);
+   }
+   g_ptr_array_set_size(items, 0);
+
+   if (updates->len > 0)
+      replace_items(updates);
+   g_ptr_array_free(updates, TRUE);
+}
+
+/* Last batch of refresh_store(): remove the records the read didn't find. Many removals (e.g. after rm *) are made
+ * in one pass with the view detached: a row-deleted signal per row would be O(n^2).
+ */
+static void reconcile_finish(void)
+{
+   GArray *removed=g_array_new(FALSE, FALSE, sizeof(guint));
+   RFM_ViewState state;
+   GtkTreeIter iter;
+   guint record;
+   guint i;
+
+   for (record=0; record<rfm_reconcileSeen->len; record++) {
+      if (rfm_reconcileSeen->data[record]==0 && RFM_STORE_RECORD(store, record)!=NULL)
+         g_array_append_val(removed, record);
+   }
+   if (removed->len >= RFM_BULK_MIN) {
+      iconView_save(&state);
+      iconView_detach();
+      rfm_store_remove_records(store, removed);
+      iconView_attach();
+      iconView_restore(&state);
+   }
+   else {
+      for (i=0; i<removed->len; i++) {
+         rfm_store_set_iter(store, &iter, g_array_index(removed, guint, i));
+         rfm_store_remove(store, &iter);
+      }
+   }
+   g_array_free(removed, TRUE);
+   g_byte_array_free(rfm_reconcileSeen, TRUE);
+   rfm_reconcileSeen=NULL;
+}
+
+static void free_readDirCtx(RFM_ReadDirCtx *ctx)
+{
+   g_free(ctx->path);
+   g_free(ctx->snapshotPath);
+   g_hash_table_unref(ctx->mount_hash);
+   arena_unref(ctx->arena);
+   default_pixbufs_unref(ctx->defaultPixbufs);
+   g_free(ctx);
+}
+
+static RFM_ReadDirBatch *new_readDirBatch(RFM_ReadDirCtx *ctx)
+{
+   RFM_ReadDirBatch *batch=g_new0(RFM_ReadDirBatch, 1);
+   batch->generation=ctx->generation;
+   batch->arena=arena_ref(ctx->arena);
+   batch->fileAttributes=g_ptr_array_new();
+   batch->updates=g_ptr_array_new();
+   return batch;
+}
+
+/* Entries are stat'ed in inode order */
+static gint compare_dirEntry_inode(gconstpointer a, gconstpointer b)
+{
+   const RFM_DirEntry *entryA=a, *entryB=b;
+   return (entryA->ino > entryB->ino) - (entryA->ino < entryB->ino);
+}
+
+static const gchar *snapshot_pool(RFM_SnapshotHeader *header)
+{
+   return (const gchar*)((RFM_SnapshotRecord*)(header+1)+header->n_records);
+}
+
+/* Map the snapshot for a directory if it is still valid: the directory device, inode and mtime must be the same */
+static GMappedFile *snapshot_open(const gchar *snapshotPath, const gchar *path, struct stat *dirStat)
+{
+   GMappedFile *snapshot=g_mapped_file_new(snapshotPath, FALSE, NULL);
+   RFM_SnapshotHeader *header;
+   RFM_SnapshotRecord *records;
+   gsize length, pool_size;
+   guint i;
+
+   if (snapshot==NULL)
+      return NULL;
+   length=g_mapped_file_get_length(snapshot);
+   header=(RFM_SnapshotHeader*)g_mapped_file_get_contents(snapshot);
+   if (length < sizeof(RFM_SnapshotHeader) || memcmp(header->magic, RFM_SNAPSHOT_MAGIC, sizeof(header->magic))!=0
+         || length-sizeof(RFM_SnapshotHeader) <= (gsize)header->n_records*sizeof(RFM_SnapshotRecord))
+      goto invalid;
+   pool_size=length-sizeof(RFM_SnapshotHeader)-header->n_records*sizeof(RFM_SnapshotRecord);
+   if (((gchar*)header)[length-1]!='\0' || header->path >= pool_size)
+      goto invalid;
+   if (header->dev!=(guint64)dirStat->st_dev || header->ino!=(guint64)dirStat->st_ino
+         || header->mtime_sec!=(gint64)dirStat->st_mtim.tv_sec || header->mtime_nsec!=(gint64)dirStat->st_mtim.tv_nsec)
+      goto invalid;
+   if (strcmp(snapshot_pool(header)+header->path, path)!=0)
+      goto invalid;   /* md5 clash */
+   records=(RFM_SnapshotRecord*)(header+1);
+   for (i=0; i<header->n_records; i++) {
+      if (records[i].name==0 || records[i].name >= pool_size || records[i].mime >= pool_size)
+         goto invalid;
+   }
+   return snapshot;
+
+invalid:
+   g_mapped_file_unref(snapshot);
+   return NULL;
+}
+
+/* Find name in a snapshot: records are sorted by name */
+static RFM_SnapshotRecord *snapshot_find(RFM_SnapshotHeader *header, const gchar *name)
+{
+   RFM_SnapshotRecord *records=(RFM_SnapshotRecord*)(header+1);
+   const gchar *pool=snapshot_pool(header);
+   guint lo=0, hi=header->n_records, mid;
+   gint cmp;
+
+   while (lo < hi) {
+      mid=lo+(hi-lo)/2;
+      cmp=strcmp(name, pool+records[mid].name);
+      if (cmp==0)
+         return &records[mid];
+      if (cmp < 0)
+         hi=mid;
+      else
+         lo=mid+1;
+   }
+   return NULL;
+}
+
+static RFM_FileAttributes *snapshot_fileAttributes(RFM_ReadDirCtx *ctx, const gchar *pool, RFM_SnapshotRecord *record)
+{
+   RFM_FileAttributes *fileAttributes;
+   gboolean is_broken=(record->flags & RFM_SNAPSHOT_BROKEN);
+   gboolean is_dir=S_ISDIR(record->mode) && !is_broken;
+
+   fileAttributes=new_fileAttributes(ctx->arena, ctx->path, pool+record->name, record->flags & RFM_SNAPSHOT_SYMLINK, record->mtime, record->size, ctx->mtimeThreshold);
+   set_file_type(ctx->arena, fileAttributes, is_dir, is_broken, (is_dir || is_broken) ? NULL : g_strdup(record->mime ? pool+record->mime : "application/octet-stream"), ctx->mount_hash, ctx->defaultPixbufs);
+   fileAttributes->mime_guessed=(record->flags & RFM_SNAPSHOT_GUESSED)!=0;
+   return fileAttributes;
+}
+
+static guint32 snapshot_add_string(GString *pool, const gchar *string)
+{
+   guint32 offset=pool->len;
+
+   if (string==NULL || string[0]=='\0')
+      return 0;
+   g_string_append_len(pool, string, strlen(string)+1);
+   return offset;
+}
+
+static void snapshot_add(GArray *records, GString *pool, RFM_DirEntry *entry, const gchar *mime, gboolean guessed)
+{
+   RFM_SnapshotRecord record;
+
+   memset(&record, 0, sizeof(record));
+   record.name=snapshot_add_string(pool, entry->name);
+   record.mime=snapshot_add_string(pool, mime);
+   record.mode=entry->statbuf.st_mode;
+   record.mtime=entry->statbuf.st_mtim.tv_sec;
+   record.mtime_nsec=entry->statbuf.st_mtim.tv_nsec;
+   record.size=entry->statbuf.st_size;
+   if (entry->is_symlink) record.flags|=RFM_SNAPSHOT_SYMLINK;
+   if (entry->is_broken) record.flags|=RFM_SNAPSHOT_BROKEN;
+   if (guessed) record.flags|=RFM_SNAPSHOT_GUESSED;
+   g_array_append_val(records, record);
+}
+
+static gint compare_snapshotRecord(gconstpointer a, gconstpointer b, gpointer pool)
+{
+   return strcmp((gchar*)pool+((RFM_SnapshotRecord*)a)->name, (gchar*)pool+((RFM_SnapshotRecord*)b)->name);
+}
+
+static void snapshot_write(RFM_ReadDirCtx *ctx, struct stat *dirStat, GArray *records, GString *pool)
+{
+   RFM_SnapshotHeader header;
+   GString *contents;
+
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, RFM_SNAPSHOT_MAGIC, sizeof(header.magic));
+   header.n_records=records->len;
+   header.path=snapshot_add_string(pool, ctx->path);
+   header.dev=dirStat->st_dev;
+   header.ino=dirStat->st_ino;
+   header.mtime_sec=dirStat->st_mtim.tv_sec;
+   header.mtime_nsec=dirStat->st_mtim.tv_nsec;
+   g_array_sort_with_data(records, compare_snapshotRecord, pool->str);
+
+   contents=g_string_sized_new(sizeof(header)+records->len*sizeof(RFM_SnapshotRecord)+pool->len);
+   g_string_append_len(contents, (gchar*)&header, sizeof(header));
+   g_string_append_len(contents, records->data, records->len*sizeof(RFM_SnapshotRecord));
+   g_string_append_len(contents, pool->str, pool->len);
+   if (!g_file_set_contents(ctx->snapshotPath, contents->str, contents->len, NULL))  /* Written to a temporary file, then renamed */
+      g_warning("readDir: can't write snapshot %s", ctx->snapshotPath);
+   g_string_free(contents, TRUE);
+}
+
+typedef struct {
+   gchar *name;
+   time_t mtime;
+} RFM_SnapshotFile;
+
+static gint compare_snapshotFile(gconstpointer a, gconstpointer b)
+{
+   time_t mtimeA=((const RFM_SnapshotFile*)a)->mtime, mtimeB=((const RFM_SnapshotFile*)b)->mtime;
+   return (mtimeA < mtimeB) - (mtimeA > mtimeB);   /* Newest first */
 }
 
-static gboolean mkThumb()
+/* Thread, once at startup: remove snapshots not used for RFM_SNAPSHOT_MAX_AGE days, then all but the
+ * RFM_SNAPSHOT_MAX_FILES most recently used. A snapshot's mtime is its last use (see readDir()).
+ */
+static gpointer snapshot_prune(gpointer user_data)
 {
-   RFM_ThumbQueueData *thumbData;
-   GdkPixbuf *thumb;
+   gchar *snapshotDir=user_data;   /* A copy: the thread may outlive rfm_snapshotDir at exit */
+   GArray *files=g_array_new(FALSE, FALSE, sizeof(RFM_SnapshotFile));
+   RFM_SnapshotFile file;
+   time_t oldest=time(NULL)-RFM_SNAPSHOT_MAX_AGE*24*60*60;
+   struct dirent *de;
+   struct stat statbuf;
+   DIR *dir;
+   int fd;
+   guint i;
 
-   thumbData=(RFM_ThumbQueueData*)rfm_thumbQueue->data;
-   if (thumbnailers[thumbData->t_idx].func==NULL)
-      thumb=gdk_pixbuf_new_from_file_at_scale(thumbData->path, RFM_THUMBNAIL_SIZE, RFM_THUMBNAIL_SIZE, TRUE, NULL);
-   else
-      thumb=thumbnailers[thumbData->t_idx].func(thumbData->path, RFM_THUMBNAIL_SIZE);
-   if (thumb!=NULL) {
-      rfm_saveThumbnail(thumb, thumbData);
-      g_object_unref(thumb);
+   if ((dir=opendir(snapshotDir))!=NULL) {
+      fd=dirfd(dir);
+      while ((de=readdir(dir))!=NULL) {
+         if (!g_str_has_suffix(de->d_name, ".snap") || fstatat(fd, de->d_name, &statbuf, AT_SYMLINK_NOFOLLOW)!=0)
+            continue;
+         if (statbuf.st_mtime < oldest)
+            unlinkat(fd, de->d_name, 0);
+         else {
+            file.name=g_strdup(de->d_name);
+            file.mtime=statbuf.st_mtime;
+            g_array_append_val(files, file);
+         }
+      }
+      g_array_sort(files, compare_snapshotFile);
+      for (i=RFM_SNAPSHOT_MAX_FILES; i<files->len; i++)
+         unlinkat(fd, g_array_index(files, RFM_SnapshotFile, i).name, 0);
+      closedir(dir);
    }
-   if (rfm_thumbQueue->next!=NULL) {   /* More items in queue */
-      rfm_thumbQueue=g_list_next(rfm_thumbQueue);
-      return TRUE;
+   for (i=0; i<files->len; i++)
+      g_free(g_array_index(files, RFM_SnapshotFile, i).name);
+   g_array_free(files, TRUE);
+   g_free(snapshotDir);
+   return NULL;
+}
+
+/* Pass a finished batch to the main thread once RFM_READDIR_BUDGET ms have passed since the last one */
+static void readDir_flush(RFM_ReadDirCtx *ctx, RFM_ReadDirBatch **batch, gint64 *deadline)
+{
+   if (g_get_monotonic_time() >= *deadline && ((*batch)->fileAttributes->len > 0 || (*batch)->updates->len > 0)) {
+      g_async_queue_push(rfm_readDirQueue, *batch);
+      *batch=new_readDirBatch(ctx);
+      *deadline=g_get_monotonic_time()+RFM_READDIR_BUDGET*1000;
    }
-   
-   g_list_free_full(rfm_thumbQueue, (GDestroyNotify)free_thumbQueueData);
-   rfm_thumbQueue=NULL;
-   rfm_thumbScheduler=0;
-   return FALSE;  /* Finished thumb queue */
 }
 
-static RFM_ThumbQueueData *get_thumbData(GtkTreeIter *iter)
+/* Directory read thread: all file system access for a dir read is done here. Nothing is shared with
+ * the main thread except rfm_readDirQueue and rfm_readDirGeneration; items are passed in batches of
+ * RFM_READDIR_BUDGET ms and the thread gives up as soon as its generation is stale.
+ * Large directories (at least RFM_SNAPSHOT_MIN items) are saved as a snapshot under rfm_snapshotDir once read.
+ * If the snapshot is still valid next time, it is shown straight away; the directory is then scanned as usual,
+ * but only items that are new or have changed since the snapshot are looked at in detail (content type)
+ * and sent to the main thread as updates.
+ */
+static gpointer readDir(RFM_ReadDirCtx *ctx)
 {
-   GtkTreePath *treePath=NULL;
-   RFM_ThumbQueueData *thumbData;
+   int dirfd;
+   DIR *dir=NULL;
+   struct dirent *dirEntry;
+   struct stat dirStat;
+   RFM_DirEntry *entries=g_new(RFM_DirEntry, RFM_READDIR_CHUNK);
+   guint n_entries=RFM_READDIR_CHUNK;
+   guint i;
+   gboolean cancelled=FALSE;
+   gboolean changed=FALSE;
+   gint64 deadline;
    RFM_FileAttributes *fileAttributes;
+   RFM_ReadDirBatch *batch=new_readDirBatch(ctx);
+   GMappedFile *snapshot=NULL;
+   RFM_SnapshotHeader *header=NULL;
+   RFM_SnapshotRecord *record;
+   GArray *records=NULL;   /* New snapshot */
+   GString *pool=NULL;
+   gchar *mime;
+#ifdef RFM_USE_IO_URING
+   struct io_uring ring;
+   gboolean have_ring=(io_uring_queue_init(RFM_URING_DEPTH, &ring, 0)==0);
+   gboolean use_uring=have_ring;   /* Cleared if the kernel can't do statx etc. */
+#endif
+
+   dirfd=open(ctx->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   if (dirfd >= 0 && (fstat(dirfd, &dirStat)!=0 || (dir=fdopendir(dirfd))==NULL))
+      close(dirfd);
+   if (dir!=NULL) {
+      deadline=g_get_monotonic_time()+RFM_READDIR_BUDGET*1000;
+      if (ctx->snapshotPath!=NULL) {
+         records=g_array_new(FALSE, FALSE, sizeof(RFM_SnapshotRecord));
+         pool=g_string_new(NULL);
+         g_string_append_c(pool, '\0');  /* Offset 0: empty string */
+         if (!ctx->reconcile)
+            snapshot=snapshot_open(ctx->snapshotPath, ctx->path, &dirStat);
+      }
+      if (snapshot!=NULL) {
+         header=(RFM_SnapshotHeader*)g_mapped_file_get_contents(snapshot);
+         record=(RFM_SnapshotRecord*)(header+1);
+         for (i=0; i<header->n_records && !cancelled; i++) {
+            if (g_atomic_int_get(&rfm_readDirGeneration)!=ctx->generation)
+               cancelled=TRUE;
+            else if ((fileAttributes=snapshot_fileAttributes(ctx, snapshot_pool(header), &record[i]))!=NULL) {
+               g_ptr_array_add(batch->fileAttributes, fileAttributes);
+               readDir_flush(ctx, &batch, &deadline);
+            }
+         }
+      }
 
-   gtk_tree_model_get(GTK_TREE_MODEL(store), iter, COL_ATTR, &fileAttributes, -1);
-
-   if (fileAttributes->is_dir || fileAttributes->is_symlink) return NULL;
-   
-   thumbData=malloc(sizeof(RFM_ThumbQueueData));
-   if (thumbData==NULL) return NULL;
-
-   thumbData->t_idx=find_thumbnailer(fileAttributes->mime_root, fileAttributes->mime_sub_type);
-   if (thumbData->t_idx==-1) {
-      free(thumbData);
-      return NULL;  /* Don't show thumbnails for files types with no thumbnailer */
+      while (n_entries==RFM_READDIR_CHUNK && !cancelled) {
+         /* Names are cheap (readdir() fetches many per getdents64 call): collect a chunk, then stat in inode order to reduce seeks */
+         n_entries=0;
+         while (n_entries < RFM_READDIR_CHUNK && (dirEntry=readdir(dir))!=NULL) {
+            if (dirEntry->d_name[0]=='.') continue;
+            entries[n_entries].ino=dirEntry->d_ino;
+            entries[n_entries].type=dirEntry->d_type;
+            entries[n_entries].name=g_strdup(dirEntry->d_name);
+            entries[n_entries].stat_status=0;
+            entries[n_entries].is_symlink=entries[n_entries].is_broken=FALSE;
+            entries[n_entries].sniff=NULL;
+            entries[n_entries].sniff_size=-1;
+            n_entries++;
+         }
+         qsort(entries, n_entries, sizeof(RFM_DirEntry), compare_dirEntry_inode);
+#ifdef RFM_USE_IO_URING
+         if (use_uring && n_entries > 0 && g_atomic_int_get(&rfm_readDirGeneration)==ctx->generation)
+            use_uring=(uring_stat_dirEntries(&ring, dirfd, entries, n_entries, snapshot==NULL && !RFM_LAZY_MIME)==RFM_URING_OK);
+#endif
+
+         for (i=0; i<n_entries; i++) {
+            if (!cancelled && g_atomic_int_get(&rfm_readDirGeneration)==ctx->generation) {
+               record=NULL;
+               if (snapshot!=NULL) {
+                  if (entries[i].stat_status==0)
+                     stat_dirEntry(dirfd, &entries[i]);
+                  record=snapshot_find(header, entries[i].name);
+               }
+               if (record!=NULL && entries[i].stat_status==1 && record->mode==entries[i].statbuf.st_mode
+                     && record->mtime==(guint64)entries[i].statbuf.st_mtim.tv_sec && record->mtime_nsec==(guint32)entries[i].statbuf.st_mtim.tv_nsec
+                     && record->size==(guint64)entries[i].statbuf.st_size
+                     && (record->flags & (RFM_SNAPSHOT_SYMLINK | RFM_SNAPSHOT_BROKEN))==((entries[i].is_symlink ? RFM_SNAPSHOT_SYMLINK : 0) | (entries[i].is_broken ? RFM_SNAPSHOT_BROKEN : 0))) {
+                  snapshot_add(records, pool, &entries[i], snapshot_pool(header)+record->mime, record->flags & RFM_SNAPSHOT_GUESSED);   /* Unchanged */
+               }
+               else if ((fileAttributes=get_file_info(ctx->arena, dirfd, ctx->path, &entries[i], ctx->mtimeThreshold, ctx->mount_hash, ctx->defaultPixbufs, !RFM_LAZY_MIME))!=NULL) {
+                  g_ptr_array_add((record!=NULL) ? batch->updates : batch->fileAttributes, fileAttributes);
+                  changed=TRUE;
+                  if (records!=NULL) {
+                     mime=(fileAttributes->is_dir || entries[i].is_broken) ? NULL : g_strjoin("/", fileAttributes->mime_root, fileAttributes->mime_sub_type, NULL);
+                     snapshot_add(records, pool, &entries[i], mime, fileAttributes->mime_guessed);
+                     g_free(mime);
+                  }
+                  readDir_flush(ctx, &batch, &deadline);
+               }
+            }
+            else
+               cancelled=TRUE;   /* Free remaining names and stop */
+            g_free(entries[i].name);
+            g_free(entries[i].sniff);
+         }
+      }
+      closedir(dir);    /* Also closes dirfd */
    }
+#ifdef RFM_USE_IO_URING
+   if (have_ring)
+      io_uring_queue_exit(&ring);
+#endif
+   g_free(entries);
+   batch->last=TRUE;
+   g_async_queue_push(rfm_readDirQueue, batch);
+
+   if (!cancelled)
+      arena_stats(ctx->arena, ctx->path);
+   if (records!=NULL && !cancelled) {
+      if (records->len >= RFM_SNAPSHOT_MIN && (snapshot==NULL || changed))
+         snapshot_write(ctx, &dirStat, records, pool);
+      else if (records->len < RFM_SNAPSHOT_MIN)
+         unlink(ctx->snapshotPath);   /* Remove any old snapshot */
+      else
+         utimensat(AT_FDCWD, ctx->snapshotPath, NULL, 0);   /* Used: kept by snapshot_prune() */
+   }
+   if (snapshot!=NULL)
+      g_mapped_file_unref(snapshot);
+   if (records!=NULL) {
+      g_array_free(records, TRUE);
+      g_string_free(pool, TRUE);
+   }
+   free_readDirCtx(ctx);
+   return NULL;
+}
 
-   thumbData->path=g_strdup(fileAttributes->path);
-   thumbData->mtime_file=fileAttributes->file_mtime;
-   thumbData->uri=g_filename_to_uri(thumbData->path, NULL, NULL);
-   thumbData->md5=g_compute_checksum_for_string(G_CHECKSUM_MD5, thumbData->uri, -1);
-   thumbData->thumb_name=g_strdup_printf("%s.png", thumbData->md5);
-   thumbData->rfm_pid=getpid();  /* pid is used to generate a unique temporary thumbnail name */
-
-   /* Map thumb path to model reference for inotify */
-   treePath=gtk_tree_model_get_path(GTK_TREE_MODEL(store), iter);
-   g_hash_table_insert(thumb_hash, g_strdup(thumbData->thumb_name), gtk_tree_row_reference_new(GTK_TREE_MODEL(store), treePath));
-   gtk_tree_path_free(treePath);
+/* ms to wait before applying inotify changes, given the main thread time (us) the last update of the same kind took:
+ * long enough that updates take at most RFM_INOTIFY_LOAD percent of the main thread, but never less than
+ * RFM_INOTIFY_TIMEOUT, and no later than RFM_INOTIFY_MAX_DELAY after the first event waiting to be shown.
+ */
+static guint inotify_delay(gint64 cost)
+{
+   gint64 delay=cost*(100-RFM_INOTIFY_LOAD)/RFM_INOTIFY_LOAD/1000;
 
-   return thumbData;
+   delay=MAX(delay, RFM_INOTIFY_TIMEOUT);
+   if (rfm_inotifyPending > 0)
+      delay=MIN(delay, RFM_INOTIFY_MAX_DELAY-(g_get_monotonic_time()-rfm_inotifyPending)/1000);
+   return (guint)MAX(delay, 0);
 }
 
-static void free_fileAttributes(RFM_FileAttributes *fileAttributes) {
-   g_free(fileAttributes->path);
-   g_free(fileAttributes->file_name);
-   g_free(fileAttributes->display_name);
-   g_clear_object(&(fileAttributes->pixbuf));
-   g_free(fileAttributes->mime_root);
-   g_free(fileAttributes->mime_sub_type);
-   g_free(fileAttributes->icon_name);
-   g_free(fileAttributes);
+/* Read the directory again after inotify_delay(). A refresh already due isn't put off by later events, so a steady
+ * stream of them can't hold it off for ever.
+ */
+static void schedule_refresh(RFM_ctx *rfmCtx)
+{
+   if (rfmCtx->delayedRefresh_GSourceID==0)
+      rfmCtx->delayedRefresh_GSourceID=g_timeout_add(inotify_delay(rfm_refreshCost), delayed_refreshAll, rfmCtx);
 }
 
-static RFM_FileAttributes *malloc_fileAttributes(void)
+/* Main thread side of readDir(): take batches for the current generation for at most RFM_READDIR_BUDGET ms.
+ * Each batch is shown as soon as it arrives. Only the main thread touches store and thumb_hash.
+ */
+static gboolean readDirReceive(gpointer user_data)
 {
-   RFM_FileAttributes *fileAttributes=malloc(sizeof(RFM_FileAttributes));
-   if (fileAttributes==NULL)
-      return NULL;
-
-   fileAttributes->path=NULL;
-   fileAttributes->file_name=NULL;
-   fileAttributes->display_name=NULL;
-   fileAttributes->pixbuf=NULL;
-   fileAttributes->mime_root=NULL;
-   fileAttributes->mime_sub_type=NULL;
-   fileAttributes->file_mtime=0;
-   fileAttributes->is_dir=FALSE;
-   fileAttributes->is_mountPoint=FALSE;
-   fileAttributes->is_symlink=FALSE;
-   fileAttributes->icon_name=NULL;
-   return fileAttributes;
+   RFM_ctx *rfmCtx=user_data;
+   RFM_ReadDirBatch *batch;
+   gboolean last;
+   gint64 start=g_get_monotonic_time();
+   gint64 deadline=start+RFM_READDIR_BUDGET*1000;
+
+   while ((batch=g_async_queue_try_pop(rfm_readDirQueue))!=NULL) {
+      if (batch->generation!=g_atomic_int_get(&rfm_readDirGeneration)) {
+         free_readDirBatch(batch);   /* Stale batch from a stopped read */
+         continue;
+      }
+      if (rfm_reconcileSeen!=NULL)
+         reconcile_items(batch->fileAttributes);
+      else {
+         rfm_store_add_arena(store, batch->arena);
+         updateIconView(batch->fileAttributes);
+         if (batch->updates->len > 0)
+            replace_items(batch->updates);
+      }
+      last=batch->last;
+      free_readDirBatch(batch);
+      if (last) {
+         if (rfm_reconcileSeen!=NULL) {
+            reconcile_finish();
+            compact_store();
+            rfm_refreshCost=rfm_readDirCost+g_get_monotonic_time()-start;
+         }
+         rfm_readDirSheduler=0;
+         rfm_dirCacheable=(rfmCtx->delayedRefresh_GSourceID==0 && !rfm_refreshAfterRead);
+         if (rfm_refreshAfterRead) {
+            rfm_refreshAfterRead=FALSE;
+            schedule_refresh(rfmCtx);
+         }
+         return FALSE;
+      }
+      if (g_get_monotonic_time() >= deadline)
+         break;
+   }
+   rfm_readDirCost+=g_get_monotonic_time()-start;
+   return TRUE;
 }
 
-static RFM_FileAttributes *get_file_info(const gchar *name, guint64 mtimeThreshold, GHashTable *mount_hash)
+/* Give back the memory of removed and replaced items once there are more of them than half the items shown, e.g. in
+ * a spool directory that is never left. Not while anything holds record indices that can't be renumbered here: a
+ * refresh_store() read (rfm_reconcileSeen), thumbnails being loaded or content types being read, or a dialog run
+ * from a menu holding paths.
+ */
+static void compact_store(void)
 {
-   GFile *file=NULL;
-   GFileInfo *info=NULL;
-   gchar *attibuteList;
-   GFileType fileType;
-   RFM_defaultPixbufs *defaultPixbufs=g_object_get_data(G_OBJECT(window),"rfm_default_pixbufs");
-   gchar *mime_type=NULL;
-   gchar *utf8_display_name=NULL;
-   gchar *is_mounted=NULL;
-   gint i;
-   RFM_FileAttributes *fileAttributes=malloc_fileAttributes();
+   GHashTableIter iter;
+   gpointer key, value;
+   RFM_ThumbQueueData *thumbData;
+   RFM_ViewState state;
+   GList *listElement;
+   guint *remap;
+   guint n_records=store->records->len;
 
-   if (fileAttributes==NULL)
-      return NULL;
-   fileAttributes->path=g_build_filename(rfm_curPath, name, NULL);
-   attibuteList=g_strdup_printf("%s,%s,%s,%s",G_FILE_ATTRIBUTE_STANDARD_TYPE, G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE, G_FILE_ATTRIBUTE_TIME_MODIFIED, G_FILE_ATTRIBUTE_STANDARD_IS_SYMLINK); 
-   file=g_file_new_for_path(fileAttributes->path);
-   info=g_file_query_info(file, attibuteList, G_FILE_QUERY_INFO_NONE, NULL, NULL);
-   g_free(attibuteList);
-   g_object_unref(file); file=NULL;
-
-   if (info == NULL ) {
-      free_fileAttributes(fileAttributes);
-      return NULL;
+   if (store->n_dead < RFM_COMPACT_MIN || store->n_dead <= store->order->len/2
+         || rfm_reconcileSeen!=NULL || rfm_thumbLoadsPending > 0 || rfm_sniffsPending > 0 || gtk_main_level() > 1)
+      return;
+   iconView_save(&state);
+   iconView_detach();   /* The view's iters would not survive the renumbering */
+   remap=rfm_store_compact(store);
+   for (listElement=state.selected; listElement!=NULL; listElement=g_list_next(listElement))
+      listElement->data=GUINT_TO_POINTER(remap[GPOINTER_TO_UINT(listElement->data)]);   /* Shown, so not removed */
+   if (state.scroll)
+      state.topRecord=remap[state.topRecord];
+   iconView_attach();
+   iconView_restore(&state);
+
+   g_hash_table_iter_init(&iter, thumb_hash);
+   while (g_hash_table_iter_next(&iter, &key, &value)) {
+      if (GPOINTER_TO_UINT(value) >= n_records || remap[GPOINTER_TO_UINT(value)]==G_MAXUINT)
+         g_hash_table_iter_remove(&iter);
+      else
+         g_hash_table_iter_replace(&iter, GUINT_TO_POINTER(remap[GPOINTER_TO_UINT(value)]));
+   }
+   if (rfm_thumbJobs!=NULL) {
+      g_hash_table_iter_init(&iter, rfm_thumbJobs);
+      while (g_hash_table_iter_next(&iter, NULL, &value)) {
+         thumbData=value;
+         thumbData->record=(thumbData->record < n_records) ? remap[thumbData->record] : G_MAXUINT;
+         if (thumbData->record==G_MAXUINT && thumbData->state==RFM_THUMB_DONE) {   /* Item removed: others are dropped by thumb_dispatch() */
+            g_hash_table_iter_remove(&iter);
+            free_thumbQueueData(thumbData);
+         }
+      }
    }
+   g_free(remap);
+}
 
-   fileAttributes->file_mtime=g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
-   fileAttributes->file_name=g_strdup(name);
-   utf8_display_name=g_filename_to_utf8(name, -1, NULL, NULL, NULL);
-   if (fileAttributes->file_mtime > mtimeThreshold)
-      fileAttributes->display_name=g_markup_printf_escaped("<b>%s</b>", utf8_display_name);
-   else
-      fileAttributes->display_name=g_markup_printf_escaped("%s", utf8_display_name);
-   g_free(utf8_display_name);
+/* The store owns the file attributes: this frees them */
+static void clear_store(void)
+{
+   g_hash_table_remove_all(thumb_hash);
+   iconView_detach();   /* A row-deleted signal per row would be O(n^2) */
+   rfm_store_clear(store);
+   iconView_attach();
+}
 
-   fileAttributes->is_symlink=g_file_info_get_is_symlink(info);
-   fileType=g_file_info_get_file_type(info);
+static gsize dirCache_listSize(GPtrArray *fileAttributeList, GPtrArray *arenas)
+{
+   RFM_FileAttributes *fileAttributes;
+   gsize size=fileAttributeList->len*sizeof(gpointer);
+   guint i;
 
-   switch (fileType) {
-      case G_FILE_TYPE_DIRECTORY:
-         fileAttributes->is_dir=TRUE;
-         fileAttributes->mime_root=g_strdup("inode");
-         if (fileAttributes->is_symlink) {
-            fileAttributes->mime_sub_type=g_strdup("symlink");
-            fileAttributes->pixbuf=g_object_ref(defaultPixbufs->symlinkDir);
-         }
-         else if (g_hash_table_lookup_extended(mount_hash, fileAttributes->path, NULL, (gpointer)&is_mounted)) {
-            fileAttributes->mime_sub_type=g_strdup("mount-point");
-            fileAttributes->is_mountPoint=TRUE;
-            if (is_mounted[0]=='0')
-               fileAttributes->pixbuf=g_object_ref(defaultPixbufs->unmounted);
-            else
-               fileAttributes->pixbuf=g_object_ref(defaultPixbufs->mounted);
-         }
-         else {
-            fileAttributes->mime_sub_type=g_strdup("directory");
-            fileAttributes->pixbuf=g_object_ref(defaultPixbufs->dir);
-         }
-      break;
-      case G_FILE_TYPE_SPECIAL: /* socket, fifo, block device, or character device */
-      case G_FILE_TYPE_REGULAR:
-         mime_type=g_strdup(g_file_info_get_content_type(info));
-         for (i=0; i<strlen(mime_type); i++) {
-            if (mime_type[i]=='/') {
-               mime_type[i]='\0';
-               fileAttributes->mime_root=g_strdup(mime_type);
-               fileAttributes->mime_sub_type=g_strdup(mime_type+i+1);
-               mime_type[i]='-';
-               fileAttributes->icon_name=mime_type; /* icon_name takes ref */
-               break;
-            }
-         }
-         if (fileAttributes->is_symlink)
-            fileAttributes->pixbuf=g_object_ref(defaultPixbufs->symlinkFile);
-         else
-            fileAttributes->pixbuf=g_object_ref(defaultPixbufs->file);
-      break;
-      default:
-         fileAttributes->mime_root=g_strdup("application");
-         fileAttributes->mime_sub_type=g_strdup("octet-stream");
-         fileAttributes->pixbuf=g_object_ref(defaultPixbufs->broken);
-      break;
+   for (i=0; i<arenas->len; i++)
+      size+=((RFM_Arena*)g_ptr_array_index(arenas, i))->size;
+   for (i=0; i<fileAttributeList->len; i++) {
+      fileAttributes=g_ptr_array_index(fileAttributeList, i);
+      if (fileAttributes->thumbnail!=NULL) size+=gdk_pixbuf_get_byte_length(fileAttributes->thumbnail);
    }
-   g_object_unref(info); info=NULL;
-   return fileAttributes;
+   return size;
 }
 
-static void do_thumbnails(void)
+/* Remove an entry from the cache; entry->wd must be -1 if the watch is already gone */
+static void dirCache_drop(RFM_DirCacheEntry *entry)
 {
-   GtkTreeIter iter;
-   gboolean valid;
-   RFM_ThumbQueueData *thumbData=NULL;
-
-   valid=gtk_tree_model_get_iter_first(GTK_TREE_MODEL(store), &iter);
-   while (valid) {
-      thumbData=get_thumbData(&iter); /* Returns NULL if thumbnail not handled */
-      if (thumbData!=NULL) {
-         /* Try to load any existing thumbnail */
-         if (load_thumbnail(thumbData->thumb_name)==0) /* Success: thumbnail exists in cache and is valid */
-            free_thumbQueueData(thumbData);
-         else  /* Thumbnail doesn't exist or is out of date */
-            rfm_thumbQueue=g_list_append(rfm_thumbQueue, thumbData);
-      }
-      valid=gtk_tree_model_iter_next(GTK_TREE_MODEL(store), &iter);
+   g_queue_remove(&rfm_dirCache, entry);
+   rfm_dirCacheSize-=entry->size;
+   if (entry->wd >= 0) {
+      inotify_rm_watch(rfm_inotify_fd, entry->wd);
+      g_hash_table_replace(rfm_dirCacheWds, GINT_TO_POINTER(entry->wd), NULL);   /* Swallow the IN_IGNORED event */
+   }
+   if (entry->fileAttributes!=NULL) {
+      g_ptr_array_foreach(entry->fileAttributes, (GFunc)free_fileAttributes, NULL);
+      g_ptr_array_free(entry->fileAttributes, TRUE);
+      g_ptr_array_free(entry->arenas, TRUE);
    }
-   if (rfm_thumbQueue!=NULL)
-      rfm_thumbScheduler=g_idle_add((GSourceFunc)mkThumb, NULL);
+   g_free(entry->scrollName);
+   g_free(entry->path);
+   g_free(entry);
 }
 
-static void updateIconView()
+static void dirCache_clear(void)
 {
-   GList *listElement;
+   while (!g_queue_is_empty(&rfm_dirCache))
+      dirCache_drop(g_queue_peek_head(&rfm_dirCache));
+}
+
+/* Move the complete listing in the store to the directory cache, instead of freeing it when the view changes.
+ * The directory is watched with inotify while it is cached, so any change drops the entry. Thumbnails loaded
+ * are kept with the listing. Called from set_rfm_curPath() after the old watch is removed; never for rfm_thumbDir.
+ */
+static void dirCache_stash(const gchar *path)
+{
+   RFM_DirCacheEntry *entry, *oldEntry;
+   RFM_FileAttributes *fileAttributes;
    GtkTreeIter iter;
    GtkTreePath *treePath=NULL;
-   GdkPixbuf *theme_pixbuf=NULL;
-   RFM_defaultPixbufs *defaultPixbufs=g_object_get_data(G_OBJECT(window),"rfm_default_pixbufs");
-   RFM_FileAttributes *fileAttributes;
-
-   if (rfm_fileAttributeList==NULL) return;
+   struct stat statbuf;
+   int wd;
 
-   listElement=g_list_first(rfm_fileAttributeList);
-   while (listElement != NULL) {
-      fileAttributes=(RFM_FileAttributes*)listElement->data;
-      if (fileAttributes->icon_name!=NULL) {
-         /* Fall back to generic icon if possible: GTK_ICON_LOOKUP_GENERIC_FALLBACK doesn't always work, e.g. flac files */
-         if (!gtk_icon_theme_has_icon(icon_theme, fileAttributes->icon_name)) {
-            g_free(fileAttributes->icon_name);
-            fileAttributes->icon_name=g_strjoin("-", fileAttributes->mime_root, "x-generic", NULL);
-         }
+   if (RFM_DIRCACHE_SIZE==0 || store->records->len==0 || stat(path, &statbuf)!=0)
+      return;
+   wd=inotify_add_watch(rfm_inotify_fd, path, INOTIFY_MASK);
+   if (wd >= 0 && wd==rfm_thumbnail_wd)
+      inotify_add_watch(rfm_inotify_fd, rfm_thumbDir, INOTIFY_THUMB_MASK);   /* Put back: events on it are for rfm_thumbIndex */
+   if (wd < 0 || wd==rfm_curPath_wd || wd==rfm_thumbnail_wd)
+      return;  /* Can't keep the listing up to date */
+   if (g_hash_table_lookup_extended(rfm_dirCacheWds, GINT_TO_POINTER(wd), NULL, (gpointer)&oldEntry) && oldEntry!=NULL) {
+      oldEntry->wd=-1;   /* Same directory cached under another path: the watch is shared */
+      dirCache_drop(oldEntry);
+   }
 
-         theme_pixbuf=gtk_icon_theme_load_icon(icon_theme, fileAttributes->icon_name, RFM_ICON_SIZE, GTK_ICON_LOOKUP_GENERIC_FALLBACK, NULL);
-         if (theme_pixbuf!=NULL) {
-            g_object_unref(fileAttributes->pixbuf);
-            if (fileAttributes->is_symlink) {
-               fileAttributes->pixbuf=gdk_pixbuf_copy(theme_pixbuf);
-               gdk_pixbuf_composite(defaultPixbufs->symlink, fileAttributes->pixbuf, 0,0, gdk_pixbuf_get_width(defaultPixbufs->symlink), gdk_pixbuf_get_height(defaultPixbufs->symlink), 0, 0, 1, 1, GDK_INTERP_NEAREST, 200);
-            }
-            else
-               fileAttributes->pixbuf=g_object_ref(theme_pixbuf);
-            g_object_unref(theme_pixbuf);
-         }
-      }
-      gtk_list_store_insert_with_values(store, &iter, -1,
-                          COL_DISPLAY_NAME, fileAttributes->display_name,
-                          COL_PIXBUF, fileAttributes->pixbuf,
-                          COL_MTIME, fileAttributes->file_mtime,
-                          COL_ATTR, fileAttributes,
-                          -1);
+   entry=g_new0(RFM_DirCacheEntry, 1);
+   entry->path=g_strdup(path);
+   entry->wd=wd;
+   entry->mtime=statbuf.st_mtim;
+   entry->ctime=statbuf.st_ctim;
+   g_hash_table_replace(rfm_dirCacheWds, GINT_TO_POINTER(wd), entry);
 
-      if (rfm_prePath!=NULL && g_strcmp0(rfm_prePath, fileAttributes->path)==0) {
-         treePath=gtk_tree_model_get_path(GTK_TREE_MODEL(store), &iter);
-         gtk_icon_view_select_path(GTK_ICON_VIEW(icon_view), treePath);
-         gtk_icon_view_scroll_to_path(GTK_ICON_VIEW(icon_view), treePath, TRUE, 1.0, 1.0);
-         gtk_tree_path_free(treePath);
-         g_free(rfm_prePath);
-         rfm_prePath=NULL; /* No need to check any more paths once found */
+   if (gtk_icon_view_get_visible_range(GTK_ICON_VIEW(icon_view), &treePath, NULL)) {
+      if (gtk_tree_model_get_iter(GTK_TREE_MODEL(store), &iter, treePath)) {
+         gtk_tree_model_get(GTK_TREE_MODEL(store), &iter, COL_ATTR, &fileAttributes, -1);
+         entry->scrollName=g_strdup(fileAttributes->file_name);
       }
-   listElement=g_list_next(listElement);
+      gtk_tree_path_free(treePath);
    }
+
+   /* Detach the listing from the store: thumbnails being loaded are for records it no longer has */
+   g_atomic_int_inc(&rfm_thumbGeneration);
+   g_hash_table_remove_all(thumb_hash);
+   iconView_detach();
+   entry->fileAttributes=rfm_store_steal_all(store, &entry->arenas);
+   iconView_attach();
+   entry->size=dirCache_listSize(entry->fileAttributes, entry->arenas);
+
+   g_queue_push_head(&rfm_dirCache, entry);
+   rfm_dirCacheSize+=entry->size;
+   while (!g_queue_is_empty(&rfm_dirCache) && (rfm_dirCacheSize > (gsize)RFM_DIRCACHE_SIZE*1024 || g_queue_get_length(&rfm_dirCache) > RFM_DIRCACHE_DIRS))
+      dirCache_drop(g_queue_peek_tail(&rfm_dirCache));   /* Least recently used */
 }
 
-static gboolean readDirItem(GDir *dir) {
-   const gchar *name=NULL;
-   time_t mtimeThreshold=time(NULL)-RFM_MTIME_OFFSET;
+/* Show the cached listing for path, if there is one and the directory hasn't changed. Returns TRUE if the store was filled. */
+static gboolean dirCache_restore(const gchar *path)
+{
+   RFM_DirCacheEntry *entry=NULL;
    RFM_FileAttributes *fileAttributes;
-   GHashTable *mount_hash=get_mount_points();
+   GList *listElement;
+   GList *iterList=NULL;
+   GtkTreeIter iter;
+   GtkTreeIter *thumbIter;
+   GtkTreePath *treePath;
+   struct stat statbuf;
+   guint record;
+   gboolean thumbs=(rfm_do_thumbs==1 && g_file_test(rfm_thumbDir, G_FILE_TEST_IS_DIR));
 
-   name=g_dir_read_name(dir);
-   if (name!=NULL) {
-      if (name[0]!='.') {
-         fileAttributes=get_file_info(name, mtimeThreshold, mount_hash);
-         if (fileAttributes!=NULL)
-            rfm_fileAttributeList=g_list_prepend(rfm_fileAttributeList, fileAttributes);
+   for (listElement=rfm_dirCache.head; listElement!=NULL; listElement=g_list_next(listElement)) {
+      if (strcmp(((RFM_DirCacheEntry*)listElement->data)->path, path)==0) {
+         entry=listElement->data;
+         break;
       }
-      return TRUE;   /* Return TRUE if more items */
    }
-   else {   /* No more items */
-      updateIconView();
-      if (rfm_do_thumbs==1 && g_file_test(rfm_thumbDir, G_FILE_TEST_IS_DIR))
-         do_thumbnails();
+   if (entry==NULL)
+      return FALSE;
+   if (stat(path, &statbuf)!=0
+         || statbuf.st_mtim.tv_sec!=entry->mtime.tv_sec || statbuf.st_mtim.tv_nsec!=entry->mtime.tv_nsec
+         || statbuf.st_ctim.tv_sec!=entry->ctime.tv_sec || statbuf.st_ctim.tv_nsec!=entry->ctime.tv_nsec) {
+      dirCache_drop(entry);   /* Changed while not watched */
+      return FALSE;
    }
 
-   rfm_readDirSheduler=0;
-   return FALSE;
+   for (record=0; record<entry->arenas->len; record++)
+      rfm_store_add_arena(store, g_ptr_array_index(entry->arenas, record));
+   for (record=iconView_append(entry->fileAttributes); record<store->records->len; record++) {
+      fileAttributes=RFM_STORE_RECORD(store, record);
+      rfm_store_set_iter(store, &iter, record);
+      if (thumbs && fileAttributes->thumbnail==NULL) {   /* Not thumbnailed yet */
+         thumbIter=g_new(GtkTreeIter, 1);
+         *thumbIter=iter;
+         iterList=g_list_prepend(iterList, thumbIter);
+      }
+      if (entry->scrollName!=NULL && rfm_prePath==NULL && strcmp(entry->scrollName, fileAttributes->file_name)==0) {
+         treePath=gtk_tree_model_get_path(GTK_TREE_MODEL(store), &iter);
+         gtk_icon_view_scroll_to_path(GTK_ICON_VIEW(icon_view), treePath, TRUE, 0.0, 0.0);
+         gtk_tree_path_free(treePath);
+      }
+      select_prePath(fileAttributes, &iter);
+   }
+   dirCache_drop(entry);
+   rfm_dirCacheable=TRUE;
+
+   if (iterList!=NULL) {
+      do_thumbnails(g_list_reverse(iterList));
+      g_list_free_full(iterList, (GDestroyNotify)g_free);
+   }
+   return TRUE;
 }
 
-/* store hold references to rfm_fileAttributeList: these two must be freed together */
-static void clear_store(void)
+/* Start a readDir() thread for rfm_curPath; its batches are taken by readDirReceive() */
+static void start_readDir(RFM_ctx *rfmCtx, gboolean reconcile)
 {
-   g_hash_table_remove_all(thumb_hash);
-   gtk_list_store_clear(store); /* This will g_free and g_object_unref */
-   g_list_free_full(rfm_fileAttributeList, (GDestroyNotify)free_fileAttributes);
-   rfm_fileAttributeList=NULL;
+   GThread *thread;
+   GError *err=NULL;
+   RFM_ReadDirCtx *ctx;
+   gchar *md5;
+
+   if (rfm_mount_hash==NULL)
+      rfm_mount_hash=get_mount_points();
+
+   ctx=g_new(RFM_ReadDirCtx, 1);
+   ctx->path=g_strdup(rfm_curPath);
+   ctx->generation=g_atomic_int_get(&rfm_readDirGeneration);
+   ctx->mtimeThreshold=time(NULL)-RFM_MTIME_OFFSET;
+   ctx->mount_hash=g_hash_table_ref(rfm_mount_hash);
+   ctx->defaultPixbufs=default_pixbufs_ref(g_object_get_data(G_OBJECT(window),"rfm_default_pixbufs"));
+   ctx->snapshotPath=NULL;
+   ctx->arena=arena_new();
+   ctx->reconcile=reconcile;
+   if (rfm_snapshotDir!=NULL) {
+      md5=g_compute_checksum_for_string(G_CHECKSUM_MD5, rfm_curPath, -1);
+      ctx->snapshotPath=g_strdup_printf("%s%s%s.snap", rfm_snapshotDir, G_DIR_SEPARATOR_S, md5);
+      g_free(md5);
+   }
+
+   thread=g_thread_try_new("readDir", (GThreadFunc)readDir, ctx, &err);
+   if (thread==NULL) {
+      g_warning("start_readDir: Can't start readDir thread: %s", err->message);
+      g_error_free(err);
+      free_readDirCtx(ctx);
+      if (rfm_reconcileSeen!=NULL)
+         g_byte_array_free(rfm_reconcileSeen, TRUE);
+      rfm_reconcileSeen=NULL;
+      return;
+   }
+   g_thread_unref(thread);   /* Thread is not joined: it finishes on its own once stale */
+   rfm_readDirCost=0;
+   rfm_readDirSheduler=g_timeout_add(RFM_READDIR_POLL, readDirReceive, rfmCtx);
 }
 
 static void fill_store(RFM_ctx *rfmCtx)
 {
-   GDir *dir=NULL;
-
    rfm_stop_all(rfmCtx);
    clear_store();
+   rfm_dirCacheable=FALSE;
    gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(store), rfmCtx->rfm_sortColumn, GTK_SORT_ASCENDING);
-
-   dir=g_dir_open(rfm_curPath, 0, NULL);
-   if (!dir) return;
-   rfm_readDirSheduler=g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, (GSourceFunc)readDirItem, dir, (GDestroyNotify)g_dir_close);
-}
-
-static gint sort_func(GtkTreeModel *model, GtkTreeIter *a, GtkTreeIter *b, gpointer user_data)
-{
-   /* Sort directories first, then on-disk filename */
-   RFM_FileAttributes *fileAttributesA, *fileAttributesB;
-   int rv;
-
-   gtk_tree_model_get(model, a, COL_ATTR, &fileAttributesA, -1);
-   gtk_tree_model_get(model, b, COL_ATTR, &fileAttributesB, -1);
-   
-
-   if (!fileAttributesA->is_dir && fileAttributesB->is_dir) rv=1;
-   else if (fileAttributesA->is_dir && !fileAttributesB->is_dir) rv=-1;
-   else  rv=strcmp(fileAttributesA->file_name, fileAttributesB->file_name);
-
-   return rv;
+   if (!dirCache_restore(rfm_curPath))
+      start_readDir(rfmCtx, FALSE);
 }
 
-static GtkListStore *create_store(void)
+/* Read rfm_curPath again without clearing the store: the listing is diffed against it by name, inode and mtime,
+ * and only new, changed and deleted items are applied (see reconcile_items()). Thumbnails, the selection and the
+ * scroll position are kept. Any read in progress is replaced: items it hadn't sent yet are added by this one.
+ */
+static void refresh_store(RFM_ctx *rfmCtx)
 {
-   GtkListStore *store=gtk_list_store_new(NUM_COLS,
-                              G_TYPE_STRING,    /* Displayed name */
-                              GDK_TYPE_PIXBUF,  /* Displayed icon */
-                              G_TYPE_UINT64,    /* File mtime: time_t is currently 32 bit signed */
-                              G_TYPE_POINTER);  /* RFM_FileAttributes */
-
-   gtk_tree_sortable_set_default_sort_func(GTK_TREE_SORTABLE(store), sort_func, NULL, NULL);
-
-   return store;
+   stop_readDir(rfmCtx);
+   rfm_dirCacheable=FALSE;
+   rfm_reconcileSeen=g_byte_array_sized_new(store->records->len);
+   g_byte_array_set_size(rfm_reconcileSeen, store->records->len);
+   memset(rfm_reconcileSeen->data, 0, rfm_reconcileSeen->len);
+   start_readDir(rfmCtx, TRUE);
 }
 
 static void set_rfm_curPath(gchar* path)
 {
    char *msg;
    int rfm_new_wd;
+   RFM_DirCacheEntry *entry;
+   gboolean keepWatch, leavingThumbDir;
 
    /* path==rfm_curPath will not trigger inotify update. Only a problem if called from user defined toolbutton
     * which can be clicked multiple times, resulting in multiple calls with the same path
@@ -1142,13 +4322,33 @@ static void set_rfm_curPath(gchar* path)
       g_free(msg);
    }
    else {
-      inotify_rm_watch(rfm_inotify_fd, rfm_curPath_wd);
+      if (g_hash_table_lookup_extended(rfm_dirCacheWds, GINT_TO_POINTER(rfm_new_wd), NULL, (gpointer)&entry)) {
+         g_hash_table_remove(rfm_dirCacheWds, GINT_TO_POINTER(rfm_new_wd));   /* Cached dir: its watch is now rfm_curPath_wd */
+         if (entry!=NULL) {
+            entry->wd=-1;
+            if (strcmp(entry->path, path)!=0)
+               dirCache_drop(entry);
+         }
+      }
+      /* The old watch is kept if it is the thumbnail watch or the new directory's: no IN_IGNORED will follow */
+      leavingThumbDir=(rfm_curPath_wd==rfm_thumbnail_wd);
+      keepWatch=(leavingThumbDir || rfm_new_wd==rfm_curPath_wd);
+      if (leavingThumbDir)   /* Keep the watch, but only for the index */
+         inotify_add_watch(rfm_inotify_fd, rfm_thumbDir, INOTIFY_THUMB_MASK);
+      else if (!keepWatch)
+         inotify_rm_watch(rfm_inotify_fd, rfm_curPath_wd);
       rfm_curPath_wd=rfm_new_wd;
+      g_atomic_int_inc(&rfm_readDirGeneration);   /* Any read of the old dir is stale; fill_store() will follow */
+      if (rfm_dirCacheable && !leavingThumbDir)   /* The thumbnail watch can't also be a cache watch */
+         dirCache_stash(rfm_curPath);
+      rfm_dirCacheable=FALSE;
       g_free(rfm_curPath);
       rfm_curPath=g_strdup(path);
       gtk_window_set_title (GTK_WINDOW (window), rfm_curPath);
       gtk_widget_set_sensitive(GTK_WIDGET(up_button), strcmp(rfm_curPath, G_DIR_SEPARATOR_S) != 0);
       gtk_widget_set_sensitive(GTK_WIDGET(home_button), strcmp(rfm_curPath, rfm_homePath) != 0);
+      if (keepWatch)
+         fill_store(g_object_get_data(G_OBJECT(window), "rfm_ctx"));
    }
 }
 
@@ -1173,6 +4373,7 @@ static void item_activated(GtkIconView *icon_view, GtkTreePath *tree_path, gpoin
    RFM_FileAttributes *fileAttributes;
 
    gtk_tree_model_get_iter(GTK_TREE_MODEL(store), &iter, tree_path);
+   resolve_item(RFM_STORE_ITER_RECORD(&iter), TRUE);
    gtk_tree_model_get(GTK_TREE_MODEL(store), &iter, COL_ATTR, &fileAttributes, -1);
 
    if (!fileAttributes->is_dir) {
@@ -1251,18 +4452,29 @@ static void stop_clicked(GtkToolItem *item, RFM_ctx *rfmCtx)
 
 static void refresh_clicked(GtkToolItem *item, RFM_ctx *rfmCtx)
 {
-   fill_store(rfmCtx);
+   refresh_store(rfmCtx);
 }
 
+/* Right click: change to the next sort order. The store is resorted in place: rows are reordered, not read again,
+ * so thumbnails and the selection are kept.
+ */
 static void refresh_other(GtkToolItem *item, GdkEventButton *event, RFM_ctx *rfmCtx)
 {
+   static const gint sortOrders[]={ GTK_TREE_SORTABLE_DEFAULT_SORT_COLUMN_ID, COL_MTIME, RFM_SORT_SIZE, RFM_SORT_EXT, RFM_SORT_TYPE };
+   GList *selected;
+   guint i;
+
    if (event->button==3) {
-      if (gtk_tree_sortable_get_sort_column_id(GTK_TREE_SORTABLE(store),NULL,NULL)==FALSE)
-         rfmCtx->rfm_sortColumn=COL_MTIME; /* Sort in mtime order */
-      else
-         rfmCtx->rfm_sortColumn=GTK_TREE_SORTABLE_DEFAULT_SORT_COLUMN_ID;
-   
-      refresh_clicked(item, rfmCtx);
+      for (i=0; i<G_N_ELEMENTS(sortOrders)-1 && sortOrders[i]!=rfmCtx->rfm_sortColumn; i++);
+      rfmCtx->rfm_sortColumn=sortOrders[(i+1) % G_N_ELEMENTS(sortOrders)];
+      gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(store), rfmCtx->rfm_sortColumn, GTK_SORT_ASCENDING);
+      schedule_resolve();   /* Other items are in view now */
+      schedule_thumbs();
+
+      selected=gtk_icon_view_get_selected_items(GTK_ICON_VIEW(icon_view));
+      if (selected!=NULL)
+         gtk_icon_view_scroll_to_path(GTK_ICON_VIEW(icon_view), selected->data, TRUE, 0.5, 0.5);
+      g_list_free_full(selected, (GDestroyNotify)gtk_tree_path_free);
    }
 }
 
@@ -1529,7 +4741,7 @@ static void drag_local_handl(GtkWidget *widget, GdkDragContext *context, RFM_ctx
 /* Send data to drop target after receiving a request for data */
 static void drag_data_get_handl(GtkWidget *widget, GdkDragContext *context, GtkSelectionData *selection_data, guint target_type, guint time, RFM_ctx *rfmCtx)
 {
-   gchar **uriList;  /* Do not free: pointers owned by GList rfm_fileAttributeList */
+   gchar **uriList;  /* Do not free: pointers owned by store */
 
    if (target_type==TARGET_URI_LIST) {
       uriList=selection_list_to_uri(widget, rfmCtx);
@@ -1683,7 +4895,7 @@ static void file_menu_cp_mv(GtkWidget *menuitem, gpointer doCopy)
 
    g_free(src_name);
    g_list_free_full(selectionList, (GDestroyNotify)gtk_tree_path_free);
-   g_list_free(fileList);  /* Do not free src list elements: owned by GList rfm_fileAttributeList */
+   g_list_free(fileList);  /* Do not free src list elements: owned by store */
 }
 
 static void file_menu_rm(GtkWidget *menuitem, gpointer user_data)
@@ -1731,7 +4943,7 @@ static void file_menu_rm(GtkWidget *menuitem, gpointer user_data)
    if (fileList!=NULL) {
       if (response_id!=GTK_RESPONSE_CANCEL)
          exec_run_action(run_actions[2].runCmdName, fileList, i, run_actions[2].runOpts, NULL);
-      g_list_free(fileList); /* Do not free list elements: owned by GList rfm_fileAttributeList */
+      g_list_free(fileList); /* Do not free list elements: owned by store */
    }
 }
 
@@ -1756,7 +4968,7 @@ static void file_menu_exec(GtkMenuItem *menuitem, RFM_RunActions *selectedAction
       }
       exec_run_action(selectedAction->runCmdName, actionFileList, i, selectedAction->runOpts, NULL);
       g_list_free_full(selectionList, (GDestroyNotify)gtk_tree_path_free);
-      g_list_free(actionFileList); /* Do not free list elements: owned by GList rfm_fileAttributeList */
+      g_list_free(actionFileList); /* Do not free list elements: owned by store */
    }
 }
 
@@ -1823,6 +5035,7 @@ static gboolean popup_file_menu(GdkEvent *event, RFM_ctx *rfmCtx)
    RFM_FileAttributes *selection_fileAttributes, *fileAttributes;
    gboolean match_mimeRoot=TRUE, match_mimeSub=TRUE;
 
+   resolve_selection();
    selectionList=gtk_icon_view_get_selected_items(GTK_ICON_VIEW(icon_view));
    if (selectionList==NULL)
       return FALSE;
@@ -2084,54 +5297,119 @@ static GtkWidget *add_iconview(GtkWidget *rfm_main_box, RFM_ctx *rfmCtx)
    
    gtk_container_add(GTK_CONTAINER(sw), icon_view);
    gtk_widget_grab_focus(icon_view);
+   /* Items coming into view are finished by resolve_visible() */
+   g_signal_connect(gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(icon_view)), "value-changed", G_CALLBACK(view_scrolled), NULL);
+   g_signal_connect(gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(icon_view)), "changed", G_CALLBACK(view_scrolled), NULL);
    
    return icon_view;
 }
 
+/* Show a new item straight away, until inotify_flush() replaces it with the item read from disk */
 static void inotify_insert_item(gchar *name, gboolean is_dir)
 {
    RFM_defaultPixbufs *defaultPixbufs=g_object_get_data(G_OBJECT(window),"rfm_default_pixbufs");
    gchar *utf8_display_name=NULL;
+   gchar *tmp;
+   GPtrArray *newItems;
+   RFM_Arena *arena=rfm_store_arena(store);
+   RFM_FileAttributes *fileAttributes;
    GtkTreeIter iter;
-   RFM_FileAttributes *fileAttributes=malloc_fileAttributes();
 
-   if (fileAttributes==NULL) return;
    if (name[0]=='.') return; /* Don't show hidden files */
+   if (rfm_store_lookup(store, name, &iter)) return;
 
+   fileAttributes=malloc_fileAttributes(arena);
    utf8_display_name=g_filename_to_utf8(name, -1, NULL, NULL, NULL);
-   fileAttributes->file_name=g_strdup(name);
+   fileAttributes->file_name=arena_strdup(arena, name);
+   fileAttributes->extension=strrchr(fileAttributes->file_name, '.');
+   fileAttributes->collate_key=get_collate_key(arena, name);
 
    if (is_dir) {
-      fileAttributes->mime_root=g_strdup("inode");
-      fileAttributes->mime_sub_type=g_strdup("directory");
+      fileAttributes->mime_root=arena_intern(arena, "inode");
+      fileAttributes->mime_sub_type=arena_intern(arena, "directory");
       fileAttributes->pixbuf=g_object_ref(defaultPixbufs->dir);
-      fileAttributes->display_name=g_markup_printf_escaped("<b>%s</b>", utf8_display_name);
+      tmp=g_markup_printf_escaped("<b>%s</b>", utf8_display_name);
    }
-   else {   /* A new file was added, but has not completed copying, or is still open: add entry; inotify will call fill_store when complete */
-      fileAttributes->mime_root=g_strdup("application");
-      fileAttributes->mime_sub_type=g_strdup("octet-stream");
+   else {   /* A new file was added, but has not completed copying, or is still open: add entry; updated again on IN_CLOSE_WRITE */
+      fileAttributes->mime_root=arena_intern(arena, "application");
+      fileAttributes->mime_sub_type=arena_intern(arena, "octet-stream");
       fileAttributes->pixbuf=g_object_ref(defaultPixbufs->file);
-      fileAttributes->display_name=g_markup_printf_escaped("<i>%s</i>", utf8_display_name);
+      tmp=g_markup_printf_escaped("<i>%s</i>", utf8_display_name);
    }
+   fileAttributes->display_name=arena_strdup(arena, tmp);
+   g_free(tmp);
    g_free(utf8_display_name);
    
    fileAttributes->is_dir=is_dir;
-   fileAttributes->path=g_build_filename(rfm_curPath, name, NULL);
+   tmp=g_build_filename(rfm_curPath, name, NULL);
+   fileAttributes->path=arena_strdup(arena, tmp);
+   g_free(tmp);
    fileAttributes->file_mtime=(gint64)time(NULL); /* time() returns a type time_t */
-   rfm_fileAttributeList=g_list_prepend(rfm_fileAttributeList, fileAttributes);
-   gtk_list_store_insert_with_values(store, &iter, -1,
-                       COL_DISPLAY_NAME, fileAttributes->display_name,
-                       COL_PIXBUF, fileAttributes->pixbuf,
-                       COL_MTIME, fileAttributes->file_mtime, 
-                       COL_ATTR, fileAttributes,
-                       -1);
+   newItems=g_ptr_array_new();
+   g_ptr_array_add(newItems, fileAttributes);
+   rfm_store_append(store, newItems);
+   g_ptr_array_free(newItems, TRUE);
 }
 
 static gboolean delayed_refreshAll(gpointer user_data)
 {
    RFM_ctx *rfmCtx=user_data;
 
-   fill_store(rfmCtx);
+   rfmCtx->delayedRefresh_GSourceID=0;
+   if (rfm_readDirSheduler>0)
+      rfm_refreshAfterRead=TRUE;   /* Starting again would never finish under a steady stream of events: wait for the read */
+   else
+      refresh_store(rfmCtx);
+   return FALSE;
+}
+
+/* Bring the items named in rfm_dirtyNames up to date: each is stat'ed again and replaced, added, or removed if it
+ * has gone. Runs inotify_delay() ms after the first event, so a file written in several steps is read once.
+ */
+static gboolean inotify_flush(gpointer user_data)
+{
+   RFM_ctx *rfmCtx=user_data;
+   RFM_defaultPixbufs *defaultPixbufs=g_object_get_data(G_OBJECT(window),"rfm_default_pixbufs");
+   GPtrArray *updates;
+   GHashTableIter hashIter;
+   GtkTreeIter iter;
+   RFM_DirEntry entry;
+   RFM_FileAttributes *fileAttributes;
+   gpointer name;
+   int dirfd;
+   gint64 start=g_get_monotonic_time();
+
+   rfmCtx->inotifyFlush_GSourceID=0;
+   rfm_inotifyPending=0;
+   dirfd=open(rfm_curPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   if (dirfd < 0) {
+      fill_store(rfmCtx);
+      return FALSE;
+   }
+
+   updates=g_ptr_array_new();
+   g_hash_table_iter_init(&hashIter, rfm_dirtyNames);
+   while (g_hash_table_iter_next(&hashIter, &name, NULL)) {
+      memset(&entry, 0, sizeof(entry));
+      entry.type=DT_UNKNOWN;
+      entry.name=name;
+      entry.sniff_size=-1;
+      /* Content types are only read here without RFM_LAZY_MIME: otherwise by resolve_item() for the items in view */
+      fileAttributes=get_file_info(rfm_store_arena(store), dirfd, rfm_curPath, &entry, time(NULL)-RFM_MTIME_OFFSET, rfm_mount_hash, defaultPixbufs, !RFM_LAZY_MIME);
+      g_free(entry.sniff);
+      if (fileAttributes!=NULL)
+         g_ptr_array_add(updates, fileAttributes);
+      else if (rfm_store_lookup(store, name, &iter))
+         rfm_store_remove(store, &iter);   /* Deleted or moved away */
+   }
+   close(dirfd);
+   g_hash_table_remove_all(rfm_dirtyNames);
+
+   if (updates->len > 0)
+      replace_items(updates);
+   g_ptr_array_free(updates, TRUE);
+   compact_store();
+   rfm_flushCost=g_get_monotonic_time()-start;
    return FALSE;
 }
 
@@ -2141,6 +5419,7 @@ static gboolean inotify_handler(gint fd, GIOCondition condition, gpointer user_d
    int len=0, i=0;
    int refresh_view=0;
    RFM_ctx *rfmCtx=user_data;
+   RFM_DirCacheEntry *entry;
 
    len=read(fd, buffer, sizeof(buffer));
    if (len<0) {
@@ -2150,48 +5429,90 @@ static gboolean inotify_handler(gint fd, GIOCondition condition, gpointer user_d
 
    while (i<len) {
       struct inotify_event *event=(struct inotify_event *) (buffer+i);
-      
+
+      if (g_hash_table_lookup_extended(rfm_dirCacheWds, GINT_TO_POINTER(event->wd), NULL, (gpointer)&entry)) {
+         /* Cached directory changed: its listing is out of date */
+         if (event->mask & IN_IGNORED) {
+            g_hash_table_remove(rfm_dirCacheWds, GINT_TO_POINTER(event->wd));
+            if (entry!=NULL) entry->wd=-1;
+         }
+         if (entry!=NULL)
+            dirCache_drop(entry);
+         i+=sizeof(*event)+event->len;
+         continue;
+      }
+
       if (event->len && event->name[0]!='.') {
          if (event->wd==rfm_thumbnail_wd) {
+            if (g_str_has_suffix(event->name, ".png")) {   /* Not interested in temporary files */
+               if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                  g_hash_table_add(rfm_thumbIndex, g_strdup(event->name));
+               else
+                  g_hash_table_remove(rfm_thumbIndex, event->name);   /* Deleted or moved away */
+            }
             /* Update thumbnails in the current view */
             if (event->mask & IN_MOVED_TO)   /* Only update thumbnail move - not interested in temporary files */
                load_thumbnail(event->name);
          }
          else {   /* Must be from rfm_curPath_wd */
-            if (event->mask & IN_CREATE)
-               inotify_insert_item(event->name, event->mask & IN_ISDIR);
-            else
-               refresh_view=1; /* Item IN_CLOSE_WRITE, deleted or moved */
+            rfm_dirCacheable=FALSE;
+            if (rfm_inotifyPending==0)
+               rfm_inotifyPending=g_get_monotonic_time();
+            if (rfm_readDirSheduler>0)
+               refresh_view=MAX(refresh_view, 1);   /* The item may not have reached the store yet: read again */
+            else {
+               if (event->mask & IN_CREATE)
+                  inotify_insert_item(event->name, event->mask & IN_ISDIR);
+               g_hash_table_add(rfm_dirtyNames, g_strdup(event->name));   /* Created, written, deleted or moved */
+            }
+         }
+      }
+      if ((event->mask & IN_IGNORED) && event->wd==rfm_thumbnail_wd) {   /* rfm_thumbDir deleted or unmounted */
+         thumb_watch_add();
+         if (event->wd!=rfm_curPath_wd) {
+            i+=sizeof(*event)+event->len;
+            continue;
          }
       }
       if (event->mask & IN_IGNORED) /* Watch changed i.e. rfm_curPath changed */
-         refresh_view=2;
+         refresh_view=3;
 
       if (event->mask & IN_DELETE_SELF || event->mask & IN_MOVE_SELF) {
          show_msgbox("Parent directory deleted!", "Error", GTK_MESSAGE_ERROR);
          set_rfm_curPath(rfm_homePath);
-         refresh_view=2;
+         refresh_view=3;
       }
       if (event->mask & IN_UNMOUNT) {
          show_msgbox("Parent directory unmounted!", "Error", GTK_MESSAGE_ERROR);
          set_rfm_curPath(rfm_homePath);
-         refresh_view=2;
+         refresh_view=3;
       }
-      if (event->mask & IN_Q_OVERFLOW) {
-         show_msgbox("Inotify event queue overflowed!", "Error", GTK_MESSAGE_ERROR);
-         set_rfm_curPath(rfm_homePath);
-         refresh_view=2;         
+      if (event->mask & IN_Q_OVERFLOW) {   /* Events were lost: the store can't be updated item by item */
+         g_warning("inotify_handler: inotify event queue overflowed: reading %s again", rfm_curPath);
+         refresh_view=MAX(refresh_view, 2);
+         if (rfm_thumbIndex!=NULL)
+            thumb_index_start();   /* Thumbnail changes may have been lost too */
+         dirCache_clear();   /* And changes to cached directories: dirCache_restore() only checks a directory's times */
       }
       i+=sizeof(*event)+event->len;
    }
+
+   if (refresh_view==0 && g_hash_table_size(rfm_dirtyNames) > RFM_INOTIFY_MAX_NAMES)
+      refresh_view=1;   /* Cheaper to read the directory again */
+   if (refresh_view==0 && g_hash_table_size(rfm_dirtyNames) > 0 && rfmCtx->inotifyFlush_GSourceID==0)
+      rfmCtx->inotifyFlush_GSourceID=g_timeout_add(inotify_delay(rfm_flushCost), inotify_flush, user_data);
    
    switch (refresh_view) {
       case 1:  /* Delayed refresh: rate-limiter */
-         if (rfmCtx->delayedRefresh_GSourceID>0)
-            g_source_remove(rfmCtx->delayedRefresh_GSourceID);
-         rfmCtx->delayedRefresh_GSourceID=g_timeout_add(RFM_INOTIFY_TIMEOUT, delayed_refreshAll, user_data);
+         schedule_refresh(rfmCtx);
+      break;
+      case 2: /* Reconcile imediately: refresh_store() will remove delayedRefresh_GSourceID if required */
+         if (rfm_readDirSheduler>0)
+            rfm_refreshAfterRead=TRUE;   /* Don't throw away the read in progress: refresh once it ends */
+         else
+            refresh_store(rfmCtx);
       break;
-      case 2: /* Refresh imediately: fill_store() will remove delayedRefresh_GSourceID if required */
+      case 3: /* New directory: read it from scratch */
          fill_store(rfmCtx);
       break;
       default: /* Refresh not required */
@@ -2200,6 +5521,23 @@ static gboolean inotify_handler(gint fd, GIOCondition condition, gpointer user_d
    return TRUE;
 }
 
+/* Watch rfm_thumbDir, making it again if it was deleted. The watch keeps rfm_thumbIndex up to date, so the index is
+ * only read once the watch is in place; without it, thumbnails are looked for in rfm_thumbDir.
+ */
+static void thumb_watch_add(void)
+{
+   rfm_thumbIndexReady=FALSE;
+   if (g_mkdir_with_parents(rfm_thumbDir, S_IRWXU)!=0
+         || (rfm_thumbnail_wd=inotify_add_watch(rfm_inotify_fd, rfm_thumbDir, INOTIFY_THUMB_MASK)) < 0) {
+      rfm_thumbnail_wd=-1;
+      g_warning("thumb_watch_add: Failed to add watch on dir %s\n", rfm_thumbDir);
+      return;
+   }
+   if (rfm_thumbIndex==NULL)
+      rfm_thumbIndex=g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+   thumb_index_start();
+}
+
 static gboolean init_inotify(RFM_ctx *rfmCtx)
 {
    rfm_inotify_fd = inotify_init();
@@ -2207,34 +5545,37 @@ static gboolean init_inotify(RFM_ctx *rfmCtx)
       return FALSE;
    else {
       g_unix_fd_add(rfm_inotify_fd, G_IO_IN, inotify_handler, rfmCtx);
-      if (rfm_do_thumbs==1) {
-         rfm_thumbnail_wd=inotify_add_watch(rfm_inotify_fd, rfm_thumbDir, IN_MOVE);
-         if (rfm_thumbnail_wd < 0) g_warning("init_inotify: Failed to add watch on dir %s\n", rfm_thumbDir);
-      }
+      if (rfm_do_thumbs==1)
+         thumb_watch_add();
    }
    return TRUE;
 }
 
+/* Mount table is only re-read here: all directory reads share rfm_mount_hash until the next mount change */
 static gboolean mounts_handler(GUnixMountMonitor *monitor, gpointer rfmCtx)
 {
-   GList *listElement;
    RFM_FileAttributes *fileAttributes;
    GHashTable *mount_hash=get_mount_points();
+   guint i;
 
    if (mount_hash==NULL) return TRUE;
-   listElement=g_list_first(rfm_fileAttributeList);
-   while (listElement != NULL) { /* Check if there are mounts in the current view */
-      fileAttributes=(RFM_FileAttributes*)listElement->data;
+   if (rfm_mount_hash!=NULL)
+      g_hash_table_unref(rfm_mount_hash);   /* A running readDir() thread may still hold a reference */
+   rfm_mount_hash=mount_hash;
+   dirCache_clear();   /* Cached mount point icons may be out of date */
+
+   for (i=0; i<store->records->len; i++) { /* Check if there are mounts in the current view */
+      fileAttributes=RFM_STORE_RECORD(store, i);
+      if (fileAttributes==NULL)
+         continue;
       if (fileAttributes->is_mountPoint==TRUE)
          break;
       if (fileAttributes->is_dir==TRUE && g_hash_table_lookup(mount_hash, fileAttributes->path)!=NULL)
          break;
-      listElement=g_list_next(listElement);
    }
-   if (listElement!=NULL)
-      fill_store((RFM_ctx*)rfmCtx);
+   if (i<store->records->len)
+      refresh_store((RFM_ctx*)rfmCtx);   /* Only the mount point rows change */
 
-   g_hash_table_destroy(mount_hash);
    return TRUE;
 }
 
@@ -2268,24 +5609,15 @@ static GHashTable *get_mount_points(void)
       endmntent(mtab_fp);
    }
    
-   return mount_hash;   /* Must be freed after use: g_hash_table_destroy() */
+   return mount_hash;   /* Must be freed after use: g_hash_table_unref() */
 }
 
-static void free_default_pixbufs(RFM_defaultPixbufs *defaultPixbufs)
+/* Startup time, shown with G_MESSAGES_DEBUG=all: e.g. to compare RFM_ICON_ATLAS 0 and 1 */
+static gboolean first_frame(GtkWidget *widget, gpointer cr, gpointer user_data)
 {
-   g_object_unref(defaultPixbufs->file);
-   g_object_unref(defaultPixbufs->dir);
-   g_object_unref(defaultPixbufs->symlinkDir);
-   g_object_unref(defaultPixbufs->symlinkFile);
-   g_object_unref(defaultPixbufs->unmounted);
-   g_object_unref(defaultPixbufs->mounted);
-   g_object_unref(defaultPixbufs->symlink);
-   g_object_unref(defaultPixbufs->up);
-   g_object_unref(defaultPixbufs->home);
-   g_object_unref(defaultPixbufs->stop);
-   g_object_unref(defaultPixbufs->refresh);
-   g_object_unref(defaultPixbufs->info);
-   g_free(defaultPixbufs);
+   g_debug("First frame %" G_GINT64_FORMAT " ms after start", (g_get_monotonic_time()-rfm_startTime)/1000);
+   g_signal_handlers_disconnect_by_func(widget, first_frame, user_data);
+   return FALSE;
 }
 
 static int setup(char *initDir, RFM_ctx *rfmCtx)
@@ -2295,6 +5627,9 @@ static int setup(char *initDir, RFM_ctx *rfmCtx)
    RFM_fileMenu *fileMenu=NULL;
    RFM_rootMenu *rootMenu=NULL;
    RFM_defaultPixbufs *defaultPixbufs=NULL;
+   gchar *cacheDir;
+   gint n_threads;
+   GThread *thread;
 
    gtk_init(NULL, NULL);
 
@@ -2310,8 +5645,22 @@ static int setup(char *initDir, RFM_ctx *rfmCtx)
 
    rfm_homePath=g_strdup(g_get_home_dir());
    rfm_thumbDir=g_build_filename(g_get_user_cache_dir(), "thumbnails", "normal", NULL);
+   if (RFM_SNAPSHOT_MIN > 0) {
+      rfm_snapshotDir=g_build_filename(g_get_user_cache_dir(), PROG_NAME, "dirs", NULL);
+      if (g_mkdir_with_parents(rfm_snapshotDir, S_IRWXU)!=0) {
+         g_warning("Setup: Can't create directory snapshot cache %s.", rfm_snapshotDir);
+         g_free(rfm_snapshotDir);
+         rfm_snapshotDir=NULL;
+      }
+      else if ((thread=g_thread_try_new("snapshotPrune", snapshot_prune, g_strdup(rfm_snapshotDir), NULL))!=NULL)
+         g_thread_unref(thread);   /* Not joined */
+   }
 
-   thumb_hash=g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)gtk_tree_row_reference_free);
+   thumb_hash=g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+   rfm_dirtyNames=g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+   rfm_readDirQueue=g_async_queue_new();
+   rfm_sniffPool=g_thread_pool_new((GFunc)sniff_thread, NULL, RFM_SNIFF_THREADS, FALSE, NULL);
+   rfm_dirCacheWds=g_hash_table_new(g_direct_hash, g_direct_equal);
 
    if (rfm_do_thumbs==1 && !g_file_test(rfm_thumbDir, G_FILE_TEST_IS_DIR)) {
       if (g_mkdir_with_parents(rfm_thumbDir, S_IRWXU)!=0) {
@@ -2319,6 +5668,14 @@ static int setup(char *initDir, RFM_ctx *rfmCtx)
          rfm_do_thumbs=0;
       }
    }
+   if (rfm_do_thumbs==1) {
+      n_threads=RFM_THUMB_THREADS > 0 ? RFM_THUMB_THREADS : g_get_num_processors();
+      rfm_thumbJobs=g_hash_table_new(g_str_hash, g_str_equal);   /* Keys are the jobs' paths */
+      rfm_thumbPool=g_thread_pool_new((GFunc)mkThumb, NULL, n_threads, FALSE, NULL);
+      rfm_thumbsMaxInFlight=2*n_threads;
+      rfm_thumbLoadPool=g_thread_pool_new((GFunc)thumb_load, NULL, n_threads, FALSE, NULL);
+      rfm_thumbLoaded=g_async_queue_new_full((GDestroyNotify)free_thumbLoad);
+   }
    
    g_signal_connect (rfmCtx->rfm_mountMonitor, "mounts-changed", G_CALLBACK (mounts_handler), rfmCtx);
    g_signal_connect (rfmCtx->rfm_mountMonitor, "mountpoints-changed", G_CALLBACK (mounts_handler), rfmCtx); /* fstab changed */
@@ -2334,6 +5691,16 @@ static int setup(char *initDir, RFM_ctx *rfmCtx)
    #else
       icon_theme=gtk_icon_theme_get_default();
    #endif
+   rfm_iconCache=g_hash_table_new_full(icon_key_hash, icon_key_equal, g_free, (GDestroyNotify)free_cachedIcon);
+   if (RFM_ICON_ATLAS) {
+      cacheDir=g_build_filename(g_get_user_cache_dir(), PROG_NAME, NULL);
+      if (g_mkdir_with_parents(cacheDir, S_IRWXU)==0)
+         rfm_atlasPath=g_build_filename(cacheDir, "icons.cache", NULL);
+      else
+         g_warning("Setup: Can't create icon cache %s.", cacheDir);
+      g_free(cacheDir);
+   }
+   atlas_load();
 
    fileMenu=setup_file_menu();
    if (fileMenu==NULL) return 1;
@@ -2346,10 +5713,13 @@ static int setup(char *initDir, RFM_ctx *rfmCtx)
    g_object_set_data(G_OBJECT(window),"rfm_file_menu",fileMenu);
    g_object_set_data_full(G_OBJECT(window),"rfm_dnd_menu",dndMenu,(GDestroyNotify)g_free);
    g_object_set_data_full(G_OBJECT(window),"rfm_root_menu",rootMenu,(GDestroyNotify)g_free);
-   g_object_set_data_full(G_OBJECT(window),"rfm_default_pixbufs",defaultPixbufs,(GDestroyNotify)free_default_pixbufs);
-   store=create_store();   /* Who knows what this returns if it fails? */
+   g_object_set_data_full(G_OBJECT(window),"rfm_default_pixbufs",defaultPixbufs,(GDestroyNotify)default_pixbufs_unref);
+   g_object_set_data(G_OBJECT(window),"rfm_ctx",rfmCtx);   /* For set_rfm_curPath() */
+   store=rfm_store_new();
    add_toolbar(rfm_main_box, defaultPixbufs, rfmCtx);
    icon_view=add_iconview(rfm_main_box, rfmCtx);    /* Who knows what this returns if it fails? */
+   g_signal_connect(icon_theme, "changed", G_CALLBACK(icon_theme_changed), NULL);
+   g_signal_connect(icon_view, "draw", G_CALLBACK(first_frame), NULL);
 
    g_signal_connect(window,"destroy", G_CALLBACK(cleanup), rfmCtx);
 
@@ -2377,23 +5747,43 @@ static void cleanup(GtkWidget *window, RFM_ctx *rfmCtx)
    gtk_main_quit();
 
    inotify_rm_watch(rfm_inotify_fd, rfm_curPath_wd);
+   g_thread_pool_free(rfm_sniffPool, TRUE, TRUE);   /* Types still queued aren't needed */
+   dirCache_clear();
+   g_hash_table_destroy(rfm_dirCacheWds);
    if (rfm_do_thumbs==1) {
       inotify_rm_watch(rfm_inotify_fd, rfm_thumbnail_wd);
-      if (rfm_thumbQueue!=NULL)
-         g_list_free_full(rfm_thumbQueue, (GDestroyNotify)free_thumbQueueData);
+      g_atomic_int_inc(&rfm_thumbGeneration);   /* Queued jobs are skipped: wait for any being made to finish */
+      g_thread_pool_free(rfm_thumbPool, FALSE, TRUE);
+      g_thread_pool_free(rfm_thumbLoadPool, FALSE, TRUE);
+      g_queue_foreach(&rfm_thumbLoadWaiting, (GFunc)free_thumbLoad, NULL);
+      g_queue_clear(&rfm_thumbLoadWaiting);
+      g_async_queue_unref(rfm_thumbLoaded);
+      g_list_free(rfm_thumbQueue);
+      g_hash_table_foreach_remove(rfm_thumbJobs, thumb_job_free, NULL);
+      g_hash_table_destroy(rfm_thumbJobs);
+      if (rfm_thumbIndex!=NULL)
+         g_hash_table_destroy(rfm_thumbIndex);
    }
    close(rfm_inotify_fd);
 
    g_object_unref(rfmCtx->rfm_mountMonitor);
 
    g_hash_table_destroy(thumb_hash);
+   g_hash_table_destroy(rfm_dirtyNames);
+   atlas_save();
+   g_hash_table_destroy(rfm_iconCache);
+   if (rfm_mount_hash!=NULL)
+      g_hash_table_unref(rfm_mount_hash);
 
+   g_signal_handlers_disconnect_by_func(icon_theme, icon_theme_changed, NULL);
    #ifdef RFM_ICON_THEME
       g_object_unref(icon_theme);
    #endif
 
    g_free(rfm_homePath);
    g_free(rfm_thumbDir);
+   g_free(rfm_snapshotDir);
+   g_free(rfm_atlasPath);
    g_free(rfm_curPath);
    g_free(rfm_prePath);
 
@@ -2420,6 +5810,7 @@ int main(int argc, char *argv[])
    char cwd[1024]; /* Could use MAX_PATH here from limits.h, but still not guaranteed to be max */
    RFM_ctx *rfmCtx=NULL;
 
+   rfm_startTime=g_get_monotonic_time();
    rfmCtx=malloc(sizeof(RFM_ctx));
    if (rfmCtx==NULL) return 1;
    rfmCtx->rfm_localDrag=FALSE;
@@ -2427,6 +5818,7 @@ int main(int argc, char *argv[])
    rfmCtx->rfm_mountMonitor=g_unix_mount_monitor_get();
    rfmCtx->showMimeType=0;
    rfmCtx->delayedRefresh_GSourceID=0;
+   rfmCtx->inotifyFlush_GSourceID=0;
 
    if (thumbnailers[0].thumbRoot==NULL)
       rfm_do_thumbs=0;